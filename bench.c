@@ -0,0 +1,980 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <setjmp.h>
+#include <regex.h>
+
+#include "ed.h"
+#include "ll.h"
+#include "pool.h"
+#include "re.h"
+#include "scan.h"
+#include "out.h"
+#include "pipe.h"
+
+/* Benchmarks for the hot paths of the editor.
+ *
+ * edbench gen SIZE FILE	write about SIZE bytes of log-like lines
+ *				to FILE, SIZE may end in k, m or g
+ * edbench scan FILE...		newline scanning against a getline() loop
+ * edbench script N FILE	write a script of N substitutions cycling
+ *				over a few patterns to FILE, time it with
+ *				d FILE-TO-EDIT < FILE
+ * edbench search RE FILE	ll_reg_search() over the whole file with
+ *				1 to 16 threads
+ * edbench regex RE FILE	matching every line with regexec() against
+ *				re_exec() and its literal prefilter
+ * edbench undo FILE		changing every line as 1,$s would, then
+ *				undoing and redoing it
+ * edbench global RE FILE	g/RE/d on the first eighth, quarter, half
+ *				and all of FILE, to see that it scales
+ * edbench move FILE		m and t of blocks of 1, 10, 100... lines
+ * edbench page FILE		loading FILE with a node per line against
+ *				paging it, and reading lines both ways
+ * edbench prompt FILE		time to the first prompt, to 1,20p and to $p
+ *				loading FILE up front against loading it in
+ *				the background, with FILE out of the cache
+ * edbench print FILE		p, n and l of all of FILE to stdout, which
+ *				had better be a pipe (| cat >/dev/null), in
+ *				MB/s against stdio a line at a time
+ * edbench pipe FILE		w !cmd, r !cmd and 1,$!cmd with cat in MB/s,
+ *				against popen() and stdio
+ * edbench batch N FILE SCRIPT	SCRIPT on N copies of FILE in /tmp, with
+ *				a d -s per file (./d, as make builds it)
+ *				against batch mode on one thread and on
+ *				all of them
+ * edbench suite LINES [DIR]	the editor's commands on generated files of
+ *				1k, 10k... lines up to LINES, in DIR (/tmp),
+ *				a line of tab separated numbers for each,
+ *				this is what make bench runs
+ */
+
+#define RUNS 3
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *fn) {
+	perror(fn);
+	exit(EXIT_FAILURE);
+}
+
+/* The editor is linked in with its main() renamed. Errors end up back
+ * in main() here, there is no prompt to go back to.
+ */
+void ed_print(long from, long to);
+void ed_printn(long from, long to);
+void ed_list(long from, long to);
+void ed_subs(long from, long to, const char *regex, char *rest);
+void ed_join(long from, long to);
+long ed_delete(long from, long to);
+long io_load_file(FILE *fp);
+long io_add_text(long at, char *buf, size_t size);
+char *io_read_all(FILE *fp, size_t *size);
+void ed_filter(long from, long to, const char *cmd);
+int io_write_file(const char *filename, const char *mode);
+FILE *fileopen(const char *filename, const char *mode);
+int ed_batch(const char *path, int n, char **files);
+
+extern char **environ;
+
+/* Calls to the allocator made by the editor, counted by linking it with
+ * --wrap: what the C library allocates for itself isn't.
+ */
+static atomic_long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	return __real_realloc(p, size);
+}
+
+static size_t parse_size(const char *s) {
+	char *end;
+	size_t n = strtoull(s, &end, 10);
+	switch (*end) {
+		case 'g': case 'G': n <<= 10; /* fall through */
+		case 'm': case 'M': n <<= 10; /* fall through */
+		case 'k': case 'K': n <<= 10;
+	}
+	return n;
+}
+
+/* log-like lines until there are `size` bytes or `lines` lines */
+static void gen(FILE *fp, size_t size, long lines) {
+	static const char *words[] = {
+		"INFO", "ERROR", "request", "timeout", "connection", "user",
+		"handler", "took", "ms", "retrying", "GET", "/api/v1/items",
+		"200", "503", "cache", "miss",
+	};
+	uint32_t x = 2463534242u;
+	size_t written = 0;
+	for (long line = 1; written < size && line <= lines; ++line) {
+		written += fprintf(fp, "%08lu", line);
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		for (int w = x % 12 + 1; w > 0; --w) {
+			x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+			written += fprintf(fp, " %s", words[x % 16]);
+		}
+		putc('\n', fp);
+		written++;
+	}
+}
+
+/* a number of lines, which may end in k or m for thousands or millions */
+static long parse_count(const char *s) {
+	char *end;
+	long n = strtol(s, &end, 10);
+	if (*end == 'k' || *end == 'K')
+		n *= 1000;
+	else if (*end == 'm' || *end == 'M')
+		n *= 1000000;
+	return n;
+}
+
+static int bench_gen(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "edbench gen SIZE FILE\n");
+		return EXIT_FAILURE;
+	}
+	FILE *fp = fopen(argv[1], "w");
+	if (fp == NULL)
+		fail("fopen");
+	gen(fp, parse_size(argv[0]), LONG_MAX);
+	fclose(fp);
+	return EXIT_SUCCESS;
+}
+
+static long count_getline(const char *file) {
+	FILE *fp = fopen(file, "r");
+	if (fp == NULL)
+		fail("fopen");
+	char *line = NULL;
+	size_t linecap = 0;
+	long lines = 0;
+	while (getline(&line, &linecap, fp) > 0)
+		lines++;
+	free(line);
+	fclose(fp);
+	return lines;
+}
+
+static long count_scan(const char *map, size_t size) {
+	const char *nl[256];
+	const char *p = map;
+	const char *end = map + size;
+	long lines = 0;
+	size_t n;
+	while ((n = scan_newlines(p, end, nl, 256)) > 0) {
+		lines += n;
+		p = nl[n-1] + 1;
+	}
+	return lines + (p < end);
+}
+
+static void report(const char *file, size_t size, const char *method, double t, long lines) {
+	printf("%-24s %10.1f MB  %-8s %8.4f s  %8.1f MB/s  %ld lines\n",
+			file, size / 1e6, method, t, size / 1e6 / t, lines);
+}
+
+static int bench_scan(int argc, char *argv[]) {
+	static const char *scanners[] = { "scalar", "sse2", "avx2" };
+	for (int i = 0; i < argc; ++i) {
+		int fd = open(argv[i], O_RDONLY);
+		struct stat st;
+		if (fd == -1 || fstat(fd, &st) == -1)
+			fail(argv[i]);
+		if (st.st_size == 0)
+			continue;
+		char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			fail("mmap");
+		/* fault the pages in so every method reads from the page cache */
+		count_scan(map, st.st_size);
+
+		double best = 1e9;
+		long lines = 0;
+		for (int r = 0; r < RUNS; ++r) {
+			double t = now();
+			lines = count_getline(argv[i]);
+			if ((t = now() - t) < best)
+				best = t;
+		}
+		report(argv[i], st.st_size, "getline", best, lines);
+
+		for (size_t s = 0; s < sizeof(scanners) / sizeof(scanners[0]); ++s) {
+			if (scan_use(scanners[s]) == -1)
+				continue;
+			best = 1e9;
+			for (int r = 0; r < RUNS; ++r) {
+				double t = now();
+				lines = count_scan(map, st.st_size);
+				if ((t = now() - t) < best)
+					best = t;
+			}
+			report(argv[i], st.st_size, scanners[s], best, lines);
+		}
+		munmap(map, st.st_size);
+		close(fd);
+	}
+	return EXIT_SUCCESS;
+}
+
+static int bench_script(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "edbench script N FILE\n");
+		return EXIT_FAILURE;
+	}
+	static const char *patterns[] = {
+		"ERROR", "time(out)?", "[0-9]+ms", "GET /api", "cache (hit|miss)",
+		"^[0-9]+", "user", "retry(ing)?",
+	};
+	long n = strtol(argv[0], NULL, 10);
+	FILE *fp = fopen(argv[1], "w");
+	if (fp == NULL)
+		fail("fopen");
+	for (long i = 0; i < n; ++i)
+		fprintf(fp, "%lds/%s/x/g\n", i % 1000 + 1, patterns[i % 8]);
+	fprintf(fp, "Q\n");
+	fclose(fp);
+	return EXIT_SUCCESS;
+}
+
+static int bench_search(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "edbench search RE FILE\n");
+		return EXIT_FAILURE;
+	}
+	int fd = open(argv[1], O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1)
+		fail(argv[1]);
+	if (ll_map_file(fd) == -1)
+		fail("mmap");
+	close(fd);
+
+	for (int threads = 1; threads <= 16; threads *= 2) {
+		pool_init(threads);
+		double best = 1e9;
+		long matches = 0;
+		for (int r = 0; r < RUNS; ++r) {
+			double t = now();
+			regbuf_t *rbuf = ll_reg_search(1, gbl_len, argv[0], 0);
+			if ((t = now() - t) < best)
+				best = t;
+			matches = rbuf->size;
+			ll_regbuf_free(rbuf);
+		}
+		printf("%-24s %10.1f MB  %2d threads %8.4f s  %8.1f MB/s  %ld of %ld lines\n",
+				argv[1], st.st_size / 1e6, threads, best, st.st_size / 1e6 / best,
+				matches, gbl_len);
+	}
+	ll_free();
+	return EXIT_SUCCESS;
+}
+
+/* lines of the buffer matching `re`, or plain `reg` if it's NULL */
+static long count_matches(regex_t *reg, re_t *re) {
+	long matches = 0;
+	ll_iter_t it;
+	for (node_t *node = ll_iter_at(&it, 1); node != NULL; node = ll_iter_next(&it)) {
+		regmatch_t m = { .rm_so = 0, .rm_eo = node->len };
+		if (((re) ? re_exec(re, node->s, 1, &m, 0) :
+					regexec(reg, node->s, 1, &m, REG_STARTEND)) == 0)
+			matches++;
+	}
+	return matches;
+}
+
+static int bench_regex(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "edbench regex RE FILE\n");
+		return EXIT_FAILURE;
+	}
+	int fd = open(argv[1], O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1)
+		fail(argv[1]);
+	if (ll_map_file(fd) == -1)
+		fail("mmap");
+	close(fd);
+
+	re_t *re = re_get(argv[0], REG_EXTENDED | REG_NOSUB);
+	printf("%s: %s%.*s%s\n", argv[0], (re->lit) ? "literal \"" : "no literal",
+			(int) re->litlen, (re->lit) ? re->lit : "", (re->lit) ? (re->pure) ? "\", pure" : "\"" : "");
+	for (int r = 0; r < 2; ++r) {
+		double best = 1e9;
+		long matches = 0;
+		for (int i = 0; i < RUNS; ++i) {
+			double t = now();
+			matches = count_matches((r == 0) ? &re->reg : NULL, (r == 0) ? NULL : re);
+			if ((t = now() - t) < best)
+				best = t;
+		}
+		printf("%-24s %10.1f MB  %-8s %8.4f s  %8.1f MB/s  %ld of %ld lines\n",
+				argv[1], st.st_size / 1e6, (r == 0) ? "regexec" : "re_exec",
+				best, st.st_size / 1e6 / best, matches, gbl_len);
+	}
+	re_free();
+	ll_free();
+	return EXIT_SUCCESS;
+}
+
+static int bench_undo(int argc, char *argv[]) {
+	if (argc < 1) {
+		fprintf(stderr, "edbench undo FILE\n");
+		return EXIT_FAILURE;
+	}
+	int fd = open(argv[0], O_RDONLY);
+	if (fd == -1)
+		fail(argv[0]);
+	if (ll_map_file(fd) == -1)
+		fail("mmap");
+	close(fd);
+	ll_journal_clear();
+	ll_journal_limit((size_t) 4 << 30);
+
+	/* every line loses its last byte, sharing the text like s does */
+	ll_step();
+	double t = now();
+	ll_iter_t it;
+	long at = 1;
+	for (node_t *node = ll_iter_at(&it, 1); node != NULL; node = ll_iter_next(&it), ++at)
+		ll_node_set(at, node, node->s, (node->len > 0) ? node->len - 1 : 0);
+	ll_step();
+	printf("%-24s %ld lines  change %8.4f s  journal %.1f MB\n",
+			argv[0], gbl_len, now() - t, ll_journal_bytes() / 1e6);
+
+	t = now();
+	ll_undo();
+	printf("%-24s %ld lines  undo   %8.4f s\n", argv[0], gbl_len, now() - t);
+	t = now();
+	ll_redo();
+	printf("%-24s %ld lines  redo   %8.4f s\n", argv[0], gbl_len, now() - t);
+
+	/* and a delete of everything */
+	ll_step();
+	t = now();
+	ll_remove_range(1, gbl_len);
+	ll_step();
+	printf("%-24s %ld lines  1,$d   %8.4f s  journal %.1f MB\n",
+			argv[0], gbl_len, now() - t, ll_journal_bytes() / 1e6);
+	t = now();
+	ll_undo();
+	printf("%-24s %ld lines  undo   %8.4f s\n", argv[0], gbl_len, now() - t);
+	ll_free();
+	return EXIT_SUCCESS;
+}
+
+static int bench_global(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "edbench global RE FILE\n");
+		return EXIT_FAILURE;
+	}
+	ll_journal_limit(0);
+	for (int part = 8; part >= 1; part /= 2) {
+		int fd = open(argv[1], O_RDONLY);
+		if (fd == -1)
+			fail(argv[1]);
+		if (ll_map_file(fd) == -1)
+			fail("mmap");
+		close(fd);
+		long lines = gbl_len / part;
+		if (lines < gbl_len)
+			ll_remove_range(lines + 1, gbl_len);
+
+		/* what ed_global() does with d for a command list */
+		double t = now();
+		regbuf_t *rbuf = ll_reg_search(1, gbl_len, argv[0], 0);
+		ll_gmark(1, gbl_len, rbuf->buf, rbuf->size, false);
+		ll_regbuf_free(rbuf);
+		double mark = now() - t;
+		long at, deleted = 0;
+		while ((at = ll_gnext()) != 0) {
+			ll_remove_range(at, at);
+			deleted++;
+		}
+		t = now() - t;
+		printf("%-24s %10ld lines  mark %8.4f s  g/RE/d %8.4f s  %6.1f ns/line  %ld deleted\n",
+				argv[1], lines, mark, t, t * 1e9 / lines, deleted);
+		ll_free();
+	}
+	return EXIT_SUCCESS;
+}
+
+static int bench_move(int argc, char *argv[]) {
+	if (argc < 1) {
+		fprintf(stderr, "edbench move FILE\n");
+		return EXIT_FAILURE;
+	}
+	int fd = open(argv[0], O_RDONLY);
+	if (fd == -1)
+		fail(argv[0]);
+	if (ll_map_file(fd) == -1)
+		fail("mmap");
+	close(fd);
+	long len = gbl_len;
+	for (long n = 1; n < len; n *= 10) {
+		/* the first n lines to the end and back, then copied */
+		double t = now();
+		ll_move(1, n, len);
+		ll_move(len - n + 1, len, 0);
+		double m = (now() - t) / 2;
+		t = now();
+		ll_copy(1, n, len);
+		double c = now() - t;
+		ll_remove_range(len + 1, len + n);
+		printf("%-24s %10ld lines  m %10.6f s  t %10.6f s\n", argv[0], n, m, c);
+	}
+	ll_free();
+	return EXIT_SUCCESS;
+}
+
+/* resident memory in MB, from /proc */
+static double rss() {
+	FILE *fp = fopen("/proc/self/statm", "r");
+	long pages = 0;
+	if (fp == NULL || fscanf(fp, "%*s %ld", &pages) != 1)
+		pages = 0;
+	if (fp != NULL)
+		fclose(fp);
+	return pages * (double) sysconf(_SC_PAGESIZE) / 1e6;
+}
+
+static int bench_page(int argc, char *argv[]) {
+	if (argc < 1) {
+		fprintf(stderr, "edbench page FILE\n");
+		return EXIT_FAILURE;
+	}
+	for (int paged = 0; paged <= 1; ++paged) {
+		ll_page_limit((paged) ? 0 : (size_t) -1);
+		double t = now();
+		int fd = open(argv[0], O_RDONLY);
+		if (fd == -1)
+			fail(argv[0]);
+		if (ll_map_file(fd) == -1)
+			fail("mmap");
+		close(fd);
+		double load = now() - t;
+		double mem = rss();
+
+		/* lines all over the file, then all of them in order */
+		t = now();
+		uint32_t x = 2463534242u;
+		size_t bytes = 0;
+		for (int i = 0; i < 10000; ++i) {
+			x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+			bytes += ll_at(x % gbl_len + 1)->len;
+		}
+		double at = (now() - t) / 10000;
+		t = now();
+		ll_iter_t it;
+		for (node_t *node = ll_iter_at(&it, 1); node != NULL; node = ll_iter_next(&it))
+			bytes += node->len;
+		double iter = now() - t;
+		printf("%-24s %10ld lines  %-5s load %8.4f s  rss %8.1f MB  "
+				"ll_at %8.2f us  walk %8.4f s  (%zu)\n",
+				argv[0], gbl_len, (paged) ? "paged" : "nodes", load, mem,
+				at * 1e6, iter, bytes);
+		ll_free();
+	}
+	return EXIT_SUCCESS;
+}
+
+/* p and n the way they were printed before out.c */
+static void stdio_print(long from, long to) {
+	ll_iter_t it;
+	node_t *current = ll_iter_at(&it, from);
+	for (; from <= to; ++from, current = ll_iter_next(&it)) {
+		fwrite(current->s, 1, current->len, stdout);
+		putchar('\n');
+	}
+	fflush(stdout);
+}
+
+static void stdio_printn(long from, long to) {
+	ll_iter_t it;
+	node_t *current = ll_iter_at(&it, from);
+	for (int i = 1; from <= to; ++i, ++from, current = ll_iter_next(&it)) {
+		printf("%-5d%c", i, ' ');
+		fwrite(current->s, 1, current->len, stdout);
+		putchar('\n');
+	}
+	fflush(stdout);
+}
+
+static int bench_print(int argc, char *argv[]) {
+	if (argc < 1) {
+		fprintf(stderr, "edbench print FILE\n");
+		return EXIT_FAILURE;
+	}
+	int fd = open(argv[0], O_RDONLY);
+	if (fd == -1)
+		fail(argv[0]);
+	if (ll_map_file(fd) == -1)
+		fail("mmap");
+	close(fd);
+	size_t bytes = 0;
+	ll_iter_t it;
+	for (node_t *node = ll_iter_at(&it, 1); node != NULL; node = ll_iter_next(&it))
+		bytes += node->len + 1;
+
+	struct {
+		const char *name;
+		void (*print)(long, long);
+	} ways[] = {
+		{ "stdio p", stdio_print },
+		{ "p", ed_print },
+		{ "stdio n", stdio_printn },
+		{ "n", ed_printn },
+		{ "l", ed_list },
+	};
+	for (size_t w = 0; w < sizeof(ways) / sizeof(ways[0]); ++w) {
+		double best = 1e9;
+		for (int r = 0; r < RUNS; ++r) {
+			double t = now();
+			ways[w].print(1, gbl_len);
+			out_flush();
+			t = now() - t;
+			if (t < best)
+				best = t;
+		}
+		fprintf(stderr, "%-24s %10ld lines  %-8s %8.4f s  %8.1f MB/s\n", argv[0],
+				gbl_len, ways[w].name, best, bytes / 1e6 / best);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* w !cmd and r !cmd the way they went before pipe.c */
+static void popen_write(const char *cmd) {
+	FILE *fp = popen(cmd, "w");
+	if (fp == NULL)
+		fail("popen");
+	ll_iter_t it;
+	for (node_t *node = ll_iter_at(&it, 1); node != NULL; node = ll_iter_next(&it)) {
+		fwrite(node->s, 1, node->len, fp);
+		putc('\n', fp);
+	}
+	pclose(fp);
+}
+
+static void popen_read(const char *cmd) {
+	FILE *fp = popen(cmd, "r");
+	if (fp == NULL)
+		fail("popen");
+	size_t size;
+	char *buf = io_read_all(fp, &size);
+	ll_add_lines(gbl_len, buf, size, true);
+	free(buf);
+	pclose(fp);
+}
+
+static int bench_pipe(int argc, char *argv[]) {
+	if (argc < 1) {
+		fprintf(stderr, "edbench pipe FILE\n");
+		return EXIT_FAILURE;
+	}
+	char cat[PATH_MAX + 8];
+	snprintf(cat, sizeof(cat), "cat '%s'", argv[0]);
+	const char *sink = "cat >/dev/null";
+	for (int way = 0; way < 5; ++way) {
+		const char *names[] = { "popen w !", "w !", "popen r !", "r !", "1,$!" };
+		double best = 1e9;
+		size_t bytes = 0;
+		for (int r = 0; r < RUNS; ++r) {
+			int fd = open(argv[0], O_RDONLY);
+			if (fd == -1)
+				fail(argv[0]);
+			/* r ! reads into an empty buffer */
+			if ((way != 2 && way != 3) && ll_map_file(fd) == -1)
+				fail("mmap");
+			close(fd);
+			double t = now();
+			switch (way) {
+				case 0: popen_write(sink); break;
+				case 1: pipe_run(sink, 1, gbl_len, NULL); break;
+				case 2: popen_read(cat); break;
+				case 3: {
+					size_t size;
+					char *buf = pipe_run(cat, 0, 0, &size);
+					io_add_text(gbl_len, buf, size);
+					break;
+				}
+				case 4: ed_filter(1, gbl_len, "cat"); break;
+			}
+			t = now() - t;
+			if (t < best)
+				best = t;
+			bytes = 0;
+			ll_iter_t it;
+			for (node_t *node = ll_iter_at(&it, 1); node != NULL; node = ll_iter_next(&it))
+				bytes += node->len + 1;
+			ll_free();
+		}
+		printf("%-24s %-10s %8.4f s  %8.1f MB/s\n", argv[0], names[way], best,
+				bytes / 1e6 / best);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* the first `n` lines' bytes, as 1,20p would read them */
+static size_t head(long n) {
+	size_t bytes = 0;
+	ll_iter_t it;
+	node_t *node = ll_iter_at(&it, 1);
+	for (long i = 0; i < n && node != NULL; ++i, node = ll_iter_next(&it))
+		bytes += node->len;
+	return bytes;
+}
+
+static int bench_prompt(int argc, char *argv[]) {
+	if (argc < 1) {
+		fprintf(stderr, "edbench prompt FILE\n");
+		return EXIT_FAILURE;
+	}
+	for (int bg = 0; bg <= 1; ++bg) {
+		ll_background(bg);
+		for (int r = 0; r < RUNS; ++r) {
+			int fd = open(argv[0], O_RDONLY);
+			if (fd == -1)
+				fail(argv[0]);
+			/* from the disk, like a file not opened in a while */
+			fdatasync(fd);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+			double t = now();
+			if (ll_map_file(fd) == -1)
+				fail("mmap");
+			close(fd);
+			double prompt = now() - t;
+			ll_sync(22);
+			size_t bytes = head(20);
+			double first = now() - t;
+			ll_sync(LONG_MAX);
+			bytes += ll_at(gbl_len)->len;
+			double last = now() - t;
+			printf("%-24s %10ld lines  %-10s prompt %8.4f s  1,20p %8.4f s  "
+					"$p %8.4f s  (%zu)\n", argv[0], gbl_len,
+					(bg) ? "background" : "up front", prompt, first, last, bytes);
+			ll_free();
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/* `n` copies of the `size` bytes at `buf` as the files `names` */
+static void batch_copies(const char *buf, size_t size, long n, char **names) {
+	for (long i = 0; i < n; ++i) {
+		int fd = open(names[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1 || write(fd, buf, size) != (ssize_t) size)
+			fail(names[i]);
+		close(fd);
+	}
+}
+
+/* ./d -s `file` < `script`, the way a shell loop over the files would */
+static void batch_spawn(const char *script, char *file) {
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, script, O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	char *argv[] = { "d", "-s", file, NULL };
+	pid_t pid;
+	if (posix_spawn(&pid, "./d", &fa, NULL, argv, environ) != 0)
+		fail("posix_spawn ./d");
+	posix_spawn_file_actions_destroy(&fa);
+	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+		;
+}
+
+static int bench_batch(int argc, char *argv[]) {
+	if (argc < 3) {
+		fprintf(stderr, "edbench batch N FILE SCRIPT\n");
+		return EXIT_FAILURE;
+	}
+	long n = parse_count(argv[0]);
+	FILE *fp = fopen(argv[1], "r");
+	if (fp == NULL)
+		fail(argv[1]);
+	size_t size;
+	char *buf = io_read_all(fp, &size);
+	fclose(fp);
+	char **names = calloc(n, sizeof(char *));
+	if (names == NULL)
+		fail("calloc");
+	for (long i = 0; i < n; ++i) {
+		if ((names[i] = malloc(48)) == NULL)
+			fail("malloc");
+		snprintf(names[i], 48, "/tmp/edbench-batch-%ld", i);
+	}
+
+	/* what the scripts print goes nowhere */
+	int out = dup(STDOUT_FILENO);
+	int null = open("/dev/null", O_WRONLY);
+	if (out == -1 || null == -1)
+		fail("/dev/null");
+	for (int way = 0; way < 3; ++way) {
+		const char *ways[] = { "d -s each", "-x -j 1", "-x" };
+		double best = 1e9;
+		for (int r = 0; r < RUNS; ++r) {
+			batch_copies(buf, size, n, names);
+			fflush(stdout);
+			dup2(null, STDOUT_FILENO);
+			double t = now();
+			if (way == 0) {
+				for (long i = 0; i < n; ++i)
+					batch_spawn(argv[2], names[i]);
+			}
+			else {
+				pool_init((way == 1) ? 1 : 0);
+				ed_batch(argv[2], n, names);
+			}
+			t = now() - t;
+			out_flush();
+			fflush(stdout);
+			dup2(out, STDOUT_FILENO);
+			if (t < best)
+				best = t;
+		}
+		printf("%-24s %6ld files  %-10s %8.4f s  %10.0f files/s\n", argv[1], n,
+				ways[way], best, n / best);
+	}
+	for (long i = 0; i < n; ++i) {
+		unlink(names[i]);
+		free(names[i]);
+	}
+	free(names);
+	free(buf);
+	close(null);
+	close(out);
+	return EXIT_SUCCESS;
+}
+
+/* Start measuring the peak of resident memory from what it is now. The
+ * kernel resets it on a write of 5 to clear_refs.
+ */
+static void peak_reset() {
+	int fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (fd != -1) {
+		if (write(fd, "5", 1) == -1)
+			perror("clear_refs");
+		close(fd);
+	}
+}
+
+/* the peak of resident memory in kB, from /proc */
+static long peak() {
+	FILE *fp = fopen("/proc/self/status", "r");
+	char line[256];
+	long kb = 0;
+	while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+			break;
+	}
+	if (fp != NULL)
+		fclose(fp);
+	return kb;
+}
+
+/* one measurement of the suite */
+struct op {
+	const char *name;
+	double t;
+	long allocs;
+};
+
+static struct op op_start(const char *name) {
+	/* the one before is a step of its own to undo, as a command is */
+	ll_step();
+	fflush(stdout);
+	peak_reset();
+	return (struct op) { name, now(), atomic_load(&allocs) };
+}
+
+static void op_end(struct op *op, long lines, long count) {
+	double t = now() - op->t;
+	long a = atomic_load(&allocs) - op->allocs;
+	fprintf(stderr, "%ld\t%s\t%ld\t%.6f\t%ld\t%ld\n", lines, op->name, count, t, a, peak());
+}
+
+/* The commands on a file of `lines` lines in `dir`. Every command runs
+ * through the editor as it would for a user, p going to /dev/null.
+ */
+static void suite(long lines, const char *dir) {
+	char file[4096], out[4096];
+	snprintf(file, sizeof(file), "%s/edbench.%ld.txt", dir, lines);
+	snprintf(out, sizeof(out), "%s/edbench.%ld.out", dir, lines);
+	FILE *fp = fopen(file, "w");
+	if (fp == NULL)
+		fail(file);
+	gen(fp, SIZE_MAX, lines);
+	if (fclose(fp) == EOF)
+		fail(file);
+	/* the file read from the page cache, not the disk */
+	if ((fp = fopen(file, "r")) == NULL)
+		fail(file);
+	count_getline(file);
+	fclose(fp);
+
+	struct op op = op_start("load");
+	io_load_file(fileopen(file, "r"));
+	op_end(&op, lines, gbl_len);
+
+	long n = (lines < 100000) ? lines : 100000;
+	uint32_t x = 2463534242u;
+	size_t bytes = 0;
+	op = op_start("ll_at");
+	for (long i = 0; i < n; ++i) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		bytes += ll_at(x % gbl_len + 1)->len;
+	}
+	op_end(&op, lines, n);
+
+	op = op_start("print");
+	ed_print(1, gbl_len);
+	op_end(&op, lines, gbl_len);
+
+	op = op_start("search");
+	regbuf_t *rb = ll_reg_search(1, gbl_len, "timeout", 0);
+	op_end(&op, lines, rb->size);
+	ll_regbuf_free(rb);
+
+	char with[] = "TIMEOUT/g";
+	op = op_start("subs");
+	ed_subs(1, gbl_len, "time(out)?", with);
+	op_end(&op, lines, gbl_len);
+
+	/* line pairs all over the buffer, then one block */
+	n = (gbl_len / 4 < 10000) ? gbl_len / 4 : 10000;
+	op = op_start("join");
+	for (long i = 0; i < n; ++i) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		long at = x % (gbl_len - 1) + 1;
+		ed_join(at, at + 1);
+	}
+	ed_join(1, n + 1);
+	op_end(&op, lines, n);
+
+	op = op_start("delete");
+	for (long i = 0; i < n; ++i) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		ed_delete(x % gbl_len + 1, x % gbl_len + 1);
+	}
+	ed_delete(gbl_len / 4, gbl_len / 2);
+	op_end(&op, lines, n + 1);
+
+	op = op_start("save");
+	io_write_file(out, "w");
+	op_end(&op, lines, gbl_len);
+
+	ll_free();
+	unlink(out);
+	unlink(file);
+	if (bytes == 0)
+		fprintf(stderr, "no lines read\n");
+}
+
+static int bench_suite(int argc, char *argv[]) {
+	if (argc < 1) {
+		fprintf(stderr, "edbench suite LINES [DIR]\n");
+		return EXIT_FAILURE;
+	}
+	long max = parse_count(argv[0]);
+	const char *dir = (argc > 1) ? argv[1] : "/tmp";
+	/* p writes to stdout, the results go to stderr */
+	if (freopen("/dev/null", "w", stdout) == NULL)
+		fail("freopen");
+	state.script = true;
+	fprintf(stderr, "lines\top\tcount\tseconds\tallocs\tpeak_kb\n");
+	for (long lines = 1000; lines < max; lines *= 10)
+		suite(lines, dir);
+	if (max >= 1000)
+		suite(max, dir);
+	return EXIT_SUCCESS;
+}
+
+static void usage() {
+	fprintf(stderr, "Usage:\n"
+			"edbench gen SIZE FILE\n"
+			"edbench scan FILE...\n"
+			"edbench script N FILE\n"
+			"edbench search RE FILE\n"
+			"edbench regex RE FILE\n"
+			"edbench undo FILE\n"
+			"edbench global RE FILE\n"
+			"edbench move FILE\n"
+			"edbench page FILE\n"
+			"edbench prompt FILE\n"
+			"edbench print FILE\n"
+			"edbench pipe FILE\n"
+			"edbench batch N FILE SCRIPT\n"
+			"edbench suite LINES [DIR]\n");
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if (setjmp(torepl) != 0)
+		return EXIT_FAILURE;
+	if (strcmp(argv[1], "gen") == 0)
+		return bench_gen(argc - 2, argv + 2);
+	if (strcmp(argv[1], "scan") == 0)
+		return bench_scan(argc - 2, argv + 2);
+	if (strcmp(argv[1], "script") == 0)
+		return bench_script(argc - 2, argv + 2);
+	if (strcmp(argv[1], "search") == 0)
+		return bench_search(argc - 2, argv + 2);
+	if (strcmp(argv[1], "regex") == 0)
+		return bench_regex(argc - 2, argv + 2);
+	if (strcmp(argv[1], "undo") == 0)
+		return bench_undo(argc - 2, argv + 2);
+	if (strcmp(argv[1], "global") == 0)
+		return bench_global(argc - 2, argv + 2);
+	if (strcmp(argv[1], "move") == 0)
+		return bench_move(argc - 2, argv + 2);
+	if (strcmp(argv[1], "page") == 0)
+		return bench_page(argc - 2, argv + 2);
+	if (strcmp(argv[1], "prompt") == 0)
+		return bench_prompt(argc - 2, argv + 2);
+	if (strcmp(argv[1], "print") == 0)
+		return bench_print(argc - 2, argv + 2);
+	if (strcmp(argv[1], "pipe") == 0)
+		return bench_pipe(argc - 2, argv + 2);
+	if (strcmp(argv[1], "batch") == 0)
+		return bench_batch(argc - 2, argv + 2);
+	if (strcmp(argv[1], "suite") == 0)
+		return bench_suite(argc - 2, argv + 2);
+	usage();
+	return EXIT_FAILURE;
+}
@@ -8,8 +8,20 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
 #include <setjmp.h>
-
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ed.h"
+#include "ll.h"
+#include "re.h"
+#include "pool.h"
+#include "stats.h"
+#include "out.h"
+#include "pipe.h"
 
 /* COMMANDS:
  * a append at a range 5a
@@ -21,429 +33,376 @@
  * i append before
  * j join lines
  * kx mark at x
+ * l print unambiguously, escaped and folded
+ * m move a range after an address 1,5m$
+ * n print with the lines' numbers
  * q quit
  * Q unconditional q
- * r read
- * ! shell
+ * r read: r file | !ls -l
+ * ! shell, or with addresses the lines through it in place: 1,$!sort
  * t transfer/yank/copy
- * u undo
+ * u undo, as many steps back as the journal holds
+ * U redo what u undid
+ * v global on the lines not matching /RE/
  * w [!|q]
  * W noclobber w
  * # comment/set address
+ * = the number of a line, of the last by default: .= $=
  */
 
 #define EDPROMPT ":"
+/* what eval() knows the stats command by, it has no character of its own */
+#define STATSCMD '\001'
 
-/* Max replacements in a string */
-#define REPLIM 200
-
-
-jmp_buf torepl;
-
-typedef struct node {
-	struct node *prev;
-	char *s;
-	struct node *next;
-}node_t;
-
-typedef struct regbuf {
-	node_t **buf;
-	int size;
-}regbuf_t;
 
+_Thread_local jmp_buf torepl;
 
 /* struct accepted by eval().
  * filled and returned by parse()
  */
 typedef struct {
 	char cmd;
-	node_t *from;
-	node_t *to;
+	long from;
+	long to;
+	int addrs;	/* number of addresses given */
 	char *rest;
 	char mark;
 	char *regex;	
 }eval_t;
 
-/* The central data structure is a linked list.
- * Only one list exists in the memory at a time,
- * this list is accessed through these global variables
+/* The central data structure is the list of lines in ll.c,
+ * see ll.h for how it is addressed. It and `state` are the current
+ * buffer's, see ed.h.
  */
 
-uint32_t gbl_len;
-node_t *gbl_head_node;
-node_t *gbl_tail_node;
-node_t *gbl_current_node;
-
-struct {
-	char *filename;
-	bool saved;
-	char *cmd;
-	bool fromfile;
-}state;
-
-/* 
- * Maximum [book]marks 
- * From '!' (dec 33) to '~' (dec 126)
- * 126 - 33 = 93
- */
-#define MARKLIM 93 
-
-/* Mark array */
-node_t *gbl_marks[MARKLIM];
-
-const char *commandchars = "acdeEgijklmnpqQrsw!=#t";
-const char *addressbasedcommands = "acdgijklmnpqQrs=#";
+const char *commandchars = "acdeEgijklmnpqQrsuUvwW!=#t";
+const char *addressbasedcommands = "acdgijklmnpqQrstv=#";
 const char *filebasedcommands = "eEw!";
 
-/* List manipulation (ll_ prefix stands for linked list) */
-node_t *ll_add_begin(const char *s);
-node_t *ll_add_end(const char *s);
-/* add `s` after `node` */
-node_t *ll_add_node(node_t *node, const char *s);
-
-node_t *ll_remove_begin();
-node_t *ll_remove_end();
-node_t *ll_remove_node(node_t *node);
-
-node_t * ll_at(int at);
-node_t * ll_prev_node(node_t *node, int n);
-node_t * ll_next_node(node_t *node, int n);
-
-/* Return a node with `p` as its ->prev and `n` as its ->next */
-node_t *ll_make_node(node_t *p, const char *s, node_t *n);
-
-void ll_free_node(node_t **node); /* Free a node in the list */
-void ll_free(); /* Free the entire list */
-
-void ll_print(node_t *head);	/* For debugging mainly */
-
 /* parse & eval routines */
 eval_t *parse(eval_t *ev, char *exp);
  /* returns when it encounters a command character. */
 char *parse_address(eval_t *ev, char *addr);
 /* parse the expression after the command character */
 char *parse_rest(eval_t *ev, char *exp);
+/* the address after m and t */
+long parse_dest(char *s);
 /* fails when `a` points to a non-address i.e. a command character */
 int isaddresschar(char *a);
 /* returns when it encounters a non-space character */
 char *skipspaces(char *s);
+/* the first '/' at or after `s` that isn't escaped, or the NUL at the
+ * end; a backslash escapes whatever comes after it, itself included
+ */
+char *finddelim(char *s);
 #define iscommand(cmd) (strchr(commandchars, cmd))
 void eval(eval_t *ev);
 
 void ed_save(const char *filename, const char *cmd, bool quit, bool append);
 void ed_quit(bool force);
-void ed_subs(node_t *from, node_t *to, const char *regex, char *rest);
-void ed_print(node_t *from, node_t *to);
-void ed_printn(node_t *from, node_t *to);
-void ed_read(const char *filename, const char *cmd, node_t *from);
-void ed_join(node_t *from, node_t *to);
-node_t *ed_delete(node_t *from, node_t *to);
-void ed_equals(node_t *from);
-void ed_hash(node_t *from);
-
-void die(char *fn, char *cause);
-/* longjmp() to repl() */
-void io_err(const char *fmt, ...);
-/* loads a file into a linked list, returns its head */
-node_t *io_load_file(FILE *fp);
-int io_write_file(node_t *head, char *filename, char *mode);
-void io_reg_err(regex_t *regcmp, int errcode);
-
-/* return a dynamically allocated string read from stdin
- * prompt can be a string or NULL
+void ed_subs(long from, long to, const char *regex, char *rest);
+void ed_global(long from, long to, const char *regex, char *cmds, bool invert);
+void ed_print(long from, long to);
+void ed_printn(long from, long to);
+void ed_list(long from, long to);
+void ed_read(const char *filename, const char *cmd, long at);
+void ed_shell(const char *cmd);
+void ed_filter(long from, long to, const char *cmd);
+void ed_join(long from, long to);
+long ed_delete(long from, long to);
+/* copy or move lines `from` to `to` after line `at` */
+long ed_copy(long from, long to, long at);
+long ed_move(long from, long to, long at);
+void ed_equals(long at);
+void ed_hash(long at);
+/* run the script in the file `path` on the `n` `files`, see batch_file(),
+ * returns the exit status
+ */
+int ed_batch(const char *path, int n, char **files);
+
+/* loads a file into the list, returns the number of lines read */
+long io_load_file(FILE *fp);
+/* add the `size` bytes of malloc()ed text at `buf` after line `at` as
+ * views into it, the list adopts it; returns the number of lines added
+ */
+long io_add_text(long at, char *buf, size_t size);
+int io_write_file(const char *filename, const char *mode);
+/* Create a temporary file next to `filename` (following symlinks) with
+ * its permissions and owner, to be renamed over it once written. Returns
+ * its descriptor, the file's path in `path` and the temporary's in `tmp`,
+ * or -1 if `filename` can't be replaced that way: it isn't a regular
+ * file, it has other hard links, which a new file wouldn't be, or its
+ * owner can't be kept. Those are written in place.
+ */
+int io_tempfile(const char *filename, char **path, char **tmp);
+
+/* read the rest of `fp` into an allocated buffer, its size goes in `size` */
+char *io_read_all(FILE *fp, size_t *size);
+
+/* a line read from the input (stdin, or the script of batch mode),
+ * without its newline, or NULL at the end; it is good until the next
+ * call. prompt can be a string or NULL
  */
 char *io_read_line(const char *prompt);
 
 /* fileopen is fopen with error checking
  * mode: "r", "w", "w+" etc. 
  */
-FILE *fileopen(char *filename, const char *mode);
+FILE *fileopen(const char *filename, const char *mode);
 ssize_t get_line(char **line, size_t *linecap, FILE *fp);
 
-int markset(node_t *node, int at);
-node_t *markget(int at);
-void markclear(int at);
-void ed_mark(node_t *node, int rest);
+void ed_mark(long at, int rest);
+long ed_search(const char *pattern);
 
-/* Mark functions */
-int markset(node_t *node, int at) {
-	int i = at - '!';
-	gbl_marks[i] = node;
-	return i;
-}
-
-node_t *markget(int at) {
-	node_t *r = gbl_marks[at - '!'];
-	return r;
+void io_reg_err(regex_t *regcmp, int errcode) {
+	char buf[200];
+	regerror(errcode, regcmp, buf, 200);
+	out_flush();
+	fprintf(stderr, "%s", buf);
+	longjmp(torepl, 1);
 }
 
-void markclear(int at) {
-	gbl_marks[at - '!'] = NULL;
+/* Make `filename` the buffer's. The buffer keeps a copy: names come
+ * out of the command line, which the next command is read over.
+ */
+static void io_set_filename(const char *filename) {
+	if (filename == state.filename)
+		return;
+	char *s = strdup(filename);
+	if (s == NULL)
+		io_err("strdup: %s\n", strerror(errno));
+	free(state.filename);
+	state.filename = s;
 }
 
-void ll_print(node_t *head) {
-	node_t *tptr = head;
-	while (tptr != NULL) {
-		printf("%s", tptr->s);
-		tptr = tptr->next;
+FILE *fileopen(const char *filename, const char *mode) {
+	state.fromfile = true;
+	io_set_filename(filename);
+	FILE *fp = NULL;
+	struct stat st;
+	if (stat(filename, &st) == -1 && errno != ENOENT) {
+		perror("stat");
+		return NULL;
 	}
-}
-
-void ll_free_node(node_t **node) {
-	free((*node)->s);
-	free(*node);
-	(*node) = NULL;
-}
 
-node_t *ll_make_node(node_t *p, const char *s, node_t *n) {
-	node_t *node; 
-	if (!(node = calloc(1, sizeof(node_t)))) {
-		io_err("calloc: %s", strerror(errno));
-	}
-	size_t sz = strlen(s);
-	if (!(node->s = calloc(sz, sizeof(char)))) {
-		ll_free_node(&node);
-		io_err("calloc: %s", strerror(errno));
+	if ((fp = fopen(filename, mode)) == NULL) {
+		/* callers look at errno, which perror() may change */
+		int err = errno;
+		perror("fopen");
+		errno = err;
+		return NULL;
 	}
-	strncpy(node->s, s, sz);
-	node->next = n;
-	node->prev = p;
-	return node;
+	return fp;
 }
 
-node_t *ll_add_begin(const char *s) {
-	state.saved = false;
-	node_t *newnode;
-	if (!gbl_head_node) {
- 		newnode = ll_make_node(NULL, s, NULL);
-		gbl_head_node = gbl_current_node = newnode;
-	}
-	else {
-		newnode = ll_make_node(NULL, s, gbl_head_node);
-		gbl_head_node->prev = newnode;
-		gbl_head_node = newnode;
-		gbl_current_node = gbl_head_node;
-	}
-	gbl_len++;
-	return gbl_current_node;
+/* the `lines` lines just loaded are all there is, nothing to undo or save */
+static long io_loaded(long lines) {
+	io_info("%ld line%s read from \"%s\"%s\n", lines,
+			(lines==1)?"":"s", 
+			(state.fromfile) ? state.filename : state.cmd,
+			(ll_loading()) ? ", the rest is loading" : "");
+	ll_journal_clear();
+	state.saved = true;
+	return lines;
 }
 
-node_t *ll_add_end(const char *s) {
-	state.saved = false;
-
-	node_t *newnode;
-	if (!gbl_tail_node) {
-		return ll_add_begin(s);
-	}
-	else {
-		newnode = ll_make_node(gbl_tail_node, s, NULL);
-		newnode->prev = gbl_tail_node;
-		gbl_tail_node->next = newnode;
-		gbl_tail_node = newnode;
-	}
-	gbl_len++;
-	return newnode;
-}
+long io_load_file(FILE *fp) {
+	ssize_t total_lines_read = 0;
 
-node_t *ll_add_node(node_t *node, const char *s) {
-	state.saved = false;
+	if (fp == NULL)
+		goto end;
 
-	node_t * newnode;
-	if (node == gbl_head_node) {
-		return ll_add_begin(s);
-	}
-	else if (node == gbl_tail_node) {
-		return ll_add_end(s);
+	/* regular files are mapped, their lines are views into the
+	 * mapping until they are changed */
+	if ((total_lines_read = ll_map_file(fileno(fp))) == -1) {
+		size_t size;
+		char *buf = io_read_all(fp, &size);
+		total_lines_read = ll_add_lines(gbl_len, buf, size, true);
+		free(buf);
 	}
-	else {
-		node_t *prv = node->prev;
-		newnode = ll_make_node(prv, s, node);
-		prv->next = newnode;
-		node->prev = newnode;	
-		gbl_len++;
-		gbl_current_node = newnode;
-		return newnode->next;
-	}
-}
 
-node_t *ll_remove_begin() {
-	state.saved = false;
-	if (!gbl_head_node) {
-		io_err("ll_remove_begin: Head empty; can't remove\n");
-	}
-	
-	node_t *rmnode = gbl_head_node;
-	gbl_head_node = gbl_head_node->next;
-	gbl_head_node->prev = NULL;
-	ll_free_node(&rmnode);
-	gbl_current_node = gbl_head_node;
-	return gbl_head_node;
+	fclose(fp);
+end:
+	return io_loaded(total_lines_read);
 }
 
-node_t *ll_remove_end() {
-	state.saved = false;
-	if (!gbl_tail_node) {
-		io_err("ll_remove_end: Tail empty; can't remove\n");
+long io_add_text(long at, char *buf, size_t size) {
+	if (size == 0) {
+		free(buf);
+		return 0;
 	}
-
-	node_t *rmnode = gbl_tail_node;
-	gbl_tail_node = gbl_tail_node->prev;
-	gbl_tail_node->next = NULL;
-	ll_free_node(&rmnode);
-	gbl_current_node = gbl_tail_node;
-	return gbl_tail_node->next;
+	ll_adopt(buf, size);
+	return ll_add_lines(at, buf, size, false);
 }
 
-node_t * ll_remove_node(node_t * node) {
-	state.saved = false;
-	if (node == gbl_head_node) {
-		return ll_remove_begin();
-	}
-	else if (node == gbl_tail_node) {
-		return ll_remove_end();
+int io_tempfile(const char *filename, char **path, char **tmp) {
+	struct stat st;
+	int fd;
+
+	*path = *tmp = NULL;
+	bool exists = stat(filename, &st) == 0;
+	if (exists) {
+		if (!S_ISREG(st.st_mode) || st.st_nlink > 1 ||
+				(*path = realpath(filename, NULL)) == NULL)
+			return -1;
 	}
 	else {
-		node_t *back = node->prev;
-		node_t *front = node->next;
-		front->prev = back;
-		back->next = front;
-		gbl_current_node = front;
-		gbl_len++;
-		ll_free_node(&node);
-		return front;
+		mode_t mask = umask(0);
+		umask(mask);
+		st.st_mode = 0666 & ~mask;
+		*path = strdup(filename);
 	}
-}
-
-node_t * ll_at(int at) {
-	node_t *current = gbl_head_node;
-	for (; at > 1 && current != NULL; at--, current = current->next);
-	return current;
-}
-
-void ll_free() {
-	node_t *current = gbl_head_node;
-	while (current != NULL) {
-		node_t *rmnode = current;
-		current = current->next;
-		ll_free_node(&rmnode);
-	}
-	gbl_head_node = NULL;
-	gbl_tail_node = NULL;
-	gbl_len = 0;
-	gbl_current_node = NULL;
-}
 
-regbuf_t *
-ll_reg_search(node_t *node, int offset, const char *regpattern) {
-	node_t *current = node;
-	regex_t reg;
-	int ret;
-
-	regbuf_t *rbuf = (regbuf_t *) calloc(1, sizeof(regbuf_t));
-	rbuf->buf = (node_t **) calloc(offset, sizeof(node_t *));
-	rbuf->size = 0;
-
-	if ((ret = regcomp(&reg, regpattern, REG_NOSUB)) != 0) {
-		io_reg_err(&reg, ret);
-		return NULL;
+	const char *base = strrchr(*path, '/');
+	base = (base) ? base + 1 : *path;
+	if (!(*tmp = malloc(strlen(*path) + 9))) {
+		io_err("malloc: %s\n", strerror(errno));
 	}
+	sprintf(*tmp, "%.*s.%s.XXXXXX", (int) (base - *path), *path, base);
 
-	for (int i = 0; i < offset || current != NULL; ++i, current = current->next) {
-		if ((ret = regexec(&reg, current->s, 0, NULL, 0)) == 0) {
-			rbuf->buf[rbuf->size] = current;
-			rbuf->size++;
-		}
+	if ((fd = mkstemp(*tmp)) != -1 && (fchmod(fd, st.st_mode & 07777) == -1 ||
+				(exists && fchown(fd, st.st_uid, st.st_gid) == -1))) {
+		close(fd);
+		unlink(*tmp);
+		fd = -1;
+	}
+	if (fd == -1) {
+		free(*path);
+		free(*tmp);
+		*path = *tmp = NULL;
 	}
-	regfree(&reg);
-	return rbuf;
+	return fd;
 }
 
-node_t * ll_prev_node(node_t *node, int n) {
-	for (; n != 0 && node != NULL; --n, node = node->prev);
-	return node;
+/* report what was written, and how with -p */
+static void io_write_stats(const char *filename) {
+	ll_wstat_t ws = ll_write_stats();
+	if (state.patch)
+		io_info("%ld line%s written to \"%s\": %zu bytes written, %zu copied, %zu kept\n",
+				gbl_len, (gbl_len==1)?"":"s", filename,
+				ws.written, ws.copied, ws.kept);
+	else
+		io_info("%ld line%s written to \"%s\"\n", gbl_len,
+				(gbl_len==1)?"":"s", filename);
 }
 
-node_t * ll_next_node(node_t *node, int n) {
-	for (; n != 0 && node != NULL; --n, node = node->next);
-	return node;
+/* `filename` was written: it is the buffer's file from now on */
+static void io_written(const char *filename) {
+	io_write_stats(filename);
+	state.fromfile = true;
+	io_set_filename(filename);
 }
 
-void io_reg_err(regex_t *regcmp, int errcode) {
-	char buf[200];
-	regerror(errcode, regcmp, buf, 200);
-	fprintf(stderr, "%s", buf);
-	longjmp(torepl, 1);
-}
+int io_write_file(const char *filename, const char *mode) {
+	char *path = NULL;
+	char *tmp = NULL;
+	int fd = -1;
+	uint64_t start = STATS_START();
 
-FILE *fileopen(char *filename, const char *mode) {
-	state.fromfile = true;
-	state.filename = filename;
-	FILE *fp = NULL;
-	struct stat st;
-	if (stat(filename, &st) == -1 && errno != ENOENT) {
-		perror("stat");
-		return NULL;
+	/* Changes to big files are often small: they can be patched into
+	 * the file loaded when the lines around them stay where they are.
+	 */
+	if (mode[0] == 'w' && state.patch && ll_ismapped(filename) &&
+			(fd = open(filename, O_WRONLY)) != -1) {
+		ssize_t bytes = ll_patch(fd);
+		if (bytes >= 0 && !(state.sync && fsync(fd) == -1)) {
+			close(fd);
+			STATS_STOP(STAT_WRITE, start, 1, ll_write_stats().written);
+			io_written(filename);
+			return 0;
+		}
+		close(fd);
+		if (bytes != -2) {
+			perror("write");
+			return -1;
+		}
+		fd = -1;
 	}
 
-	if ((fp = fopen(filename, mode)) == NULL) {
-		perror("fopen");
-		return NULL;
+	/* A file is written to a temporary one next to it which is then
+	 * renamed over it, so nobody sees it half written and the old one
+	 * stays intact for the lines still viewing its mapping.
+	 */
+	if (mode[0] == 'w')
+		fd = io_tempfile(filename, &path, &tmp);
+	/* truncating the mapped file would pull it from under its lines */
+	if (fd == -1 && mode[0] == 'w' && ll_ismapped(filename))
+		ll_detach();
+	if (fd == -1 && (fd = open(filename, O_WRONLY | O_CREAT |
+					((mode[0] == 'a') ? O_APPEND : O_TRUNC), 0666)) == -1) {
+		perror("open");
+		return -1;
 	}
-	return fp;
-}
-
-node_t *io_load_file(FILE *fp) {
 
-	if (fp == NULL)
-		goto end;
-
-	char *line = NULL;
-	size_t linecap;
-	ssize_t total_lines_read = 0;
-
-	while ((getline(&line, &linecap, fp)) > 0) {
-		ll_add_end(line);
-		total_lines_read++;
+	ssize_t bytes = ll_write(fd, 1, gbl_len);
+	if (bytes == -1 || (state.sync && fsync(fd) == -1)) {
+		perror("write");
+		close(fd);
+		if (tmp)
+			unlink(tmp);
+		goto fail;
 	}
+	close(fd);
+	if (tmp && rename(tmp, path) == -1) {
+		perror("rename");
+		unlink(tmp);
+		goto fail;
+	}
+	free(path);
+	free(tmp);
 
-	printf("%ld line%s read from \"%s\"\n", total_lines_read,
-			(total_lines_read==1)?"":"s", 
-			(state.fromfile) ? state.filename : state.cmd);
-
-	free(line);
-	fclose(fp);
-end:
-	state.saved = true;
-	return gbl_head_node;
+	STATS_STOP(STAT_WRITE, start, 1, bytes);
+	io_written(filename);
+	return 0;
+fail:
+	free(path);
+	free(tmp);
+	return -1;
 }
 
-int io_write_file(node_t *head, char *filename, char *mode) {
-	FILE *fp = fileopen(filename, mode);
+char *io_read_all(FILE *fp, size_t *size) {
+	struct stat st;
+	size_t cap = 1 << 16;
+	size_t len = 0;
+	size_t n;
 
-	size_t lines = 0;
+	if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode))
+		cap = st.st_size + 1;
 
-	node_t *current = head;
-	while(current != NULL) {
-		fprintf(fp, "%s", current->s);
-		current = current->next;
-		lines++;
+	char *buf;
+	if (!(buf = malloc(cap))) {
+		io_err("malloc: %s\n", strerror(errno));
 	}
-	printf("%ld line%s written to \"%s\"\n", lines,
-		   (lines==1)?"":"s", filename);
-	fclose(fp);
-	return 0;
+	while ((n = fread(buf + len, 1, cap - len, fp)) > 0) {
+		len += n;
+		if (len == cap && !(buf = realloc(buf, cap *= 2))) {
+			io_err("realloc: %s\n", strerror(errno));
+		}
+	}
+	*size = len;
+	return buf;
 }
 
-char *io_read_line(const char *prompt) {
-	char *line = NULL;
-	size_t linecap = 0;
+/* where the calling thread reads commands and text from, NULL for stdin */
+static _Thread_local FILE *input;
+#define io_input() ((input) ? input : stdin)
 
-	if (prompt != NULL) {
+char *io_read_line(const char *prompt) {
+	/* one buffer for every line rather than one per command */
+	static _Thread_local char *line = NULL;
+	static _Thread_local size_t linecap = 0;
+
+	/* what the last command printed goes out first, scripts wait for
+	 * the buffer to fill */
+	if (!state.script)
+		out_flush();
+	if (prompt != NULL && !state.script) {
 		printf("%s", prompt);
 	}
 	ssize_t n = 0;
-	if ((n = getline(&line, &linecap, stdin)) != -1) {
-		line[n-1] = '\0'; // remove newline at the end
+	if ((n = getline(&line, &linecap, io_input())) != -1) {
+		if (line[n-1] == '\n')
+			line[n-1] = '\0'; // remove newline at the end
 		return line;
 	}
 	return NULL;
@@ -462,6 +421,14 @@ char *skipspaces(char *s) {
 	return s;
 }
 
+char *finddelim(char *s) {
+	for (; *s != '\0' && *s != '/'; ++s) {
+		if (*s == '\\' && s[1] != '\0')
+			s++;
+	}
+	return s;
+}
+
 char *nextword(char *s) {
 	while (! isspace(*s) && *s != '\0') 
 		++s;
@@ -480,87 +447,95 @@ char *rmnewline(char *s) {
 }
 
 int isaddresschar(char *a) {
-	if (*a == '-' || *a == '+' || *a == '$' ||
-		*a == '.' || *a == ',' || isdigit(*a) ||
-		(isalpha(*a) && *(a-1) == '\'')) // apostrophe + alpha -> mark 
+	if (*a == '-' || *a == '+' || *a == '$' || *a == ';' ||
+		*a == '.' || *a == ',' || *a == '\'' || *a == '/' || isdigit(*a))
 		return 1;
 	return 0;
 }
 
+/* The current line. While a file loads it is the last line read until a
+ * command moves it, which makes it the last line of the file: it needs
+ * all of it. Commands wait for a line past the lines they go to, so one
+ * that moved it is never left at the end.
+ */
+static long current() {
+	if (gbl_current_line == gbl_len)
+		ll_sync(LONG_MAX);
+	return gbl_current_line;
+}
+
 char *parse_address(eval_t *ev, char *addr) {
 	bool commapassed = false;
+	/* the address being built and whether anything went into it */
+	long *cur = &ev->from;
+	bool seen = false;
 	while (isaddresschar(addr)) {
 		if (*addr == '.') {
-			if (commapassed) { ev->to = gbl_current_node; }
-			else { ev->from = gbl_current_node; }
+			*cur = current();
+			seen = true;
 		}
 		else if (*addr == '$') {
-			if (commapassed) { ev->to = gbl_tail_node; }
-			else { ev->from = gbl_tail_node; }
+			ll_sync(LONG_MAX);
+			*cur = gbl_len;
+			seen = true;
 		}
-		else if (*addr == ',') {
-			if (!isaddresschar(addr+1))
-				ev->from = gbl_head_node;
+		else if (*addr == ',' || *addr == ';') {
+			if (!seen)
+				ev->from = (*addr == ',') ? 1 : current();
+			/* the second address defaults to the last line, see below */
+			cur = &ev->to;
+			seen = false;
 			commapassed = true;
 		}
-		else if (*addr == '-') {
+		else if (*addr == '-' || *addr == '+') {
 			long num = 1;
+			char sign = *addr;
 			if (isdigit(*(addr+1))) {
 				num = strtol(addr + 1, &addr, 10);
+				addr--;
 			}
-
-			if (commapassed) {
-				ev->to = ll_prev_node(gbl_current_node, num);
-		   	}
-			else {
-				ev->from = ll_prev_node(gbl_current_node, num);
-			}
-			addr--;
-		}
-		else if (*addr == '+') {
-			long num = 1;
-			if (isdigit(*(addr+1))) {
-				num = strtol(addr + 1, &addr, 10);
-			}
-
-			if (commapassed) {
-				ev->to = ll_next_node(gbl_current_node, num);
-			}
-			else {
-				ev->from = ll_next_node(gbl_current_node, num);
-			}
-			addr--;
+			/* relative to the address so far, or to the current line */
+			long base = (seen) ? *cur : current();
+			*cur = (sign == '-') ? base - num : base + num;
+			seen = true;
 		}
 		else if (isdigit(*addr)) {
-			long num = strtol(addr, &addr, 10);
-			if (commapassed) {
-				ev->to = ll_at(num);
-			}
-			else {
-				ev->from = ll_at(num);
-			}
+			*cur = strtol(addr, &addr, 10);
+			seen = true;
 			addr--;
 		}
-		else if (*addr == ';') {
-			ev->from = gbl_current_node;
-			ev->to = gbl_tail_node;
-		}
 		else if (*addr == '/') {
-			char *start = addr+1;
-			addr++;
-			while (*addr != '/' && *(addr-1) != '\\') {
-				addr++;
+			char *start = ++addr;
+			addr = finddelim(addr);
+			if (*addr == '\0') {
+				addr--;
+				*cur = ed_search(start);
 			}
-			*addr = '\0';
-			ev->regex = start;
-			break;
+			else {
+				/* terminated for the search and put back */
+				*addr = '\0';
+				*cur = ed_search(start);
+				*addr = '/';
+			}
+			seen = true;
 		}
 		else if (*addr == '\'') {
-			if ((ev->from = markget(*(addr+1))) == NULL) 
+			if ((*cur = markget(*(addr+1))) == 0) 
 				io_err("Mark not set %c\n", *(addr+1));
+			seen = true;
+			addr++;
 		}
 		addr++;
 	}
+	if (!commapassed) {
+		ev->to = ev->from;
+	}
+	else if (!seen) {
+		/* only a range to the end waits for all of the file */
+		ll_sync(LONG_MAX);
+		ev->to = gbl_len;
+	}
+	ev->addrs = (commapassed) ? 2 : (seen) ? 1 : 0;
 	return addr;
 }
 
@@ -569,11 +544,11 @@ char *parse_rest(eval_t *ev, char *exp) {
 	while (*exp) {
 		if (*exp == '/') { // start of a regex
 			char *start = ++exp;
-			while (*exp != '/' && *(exp-1) != '\\') {
-				exp++;
-			}
-			*exp = '\0';
+			exp = finddelim(exp);
 			ev->regex = start;
+			if (*exp == '\0')
+				return exp;
+			*exp = '\0';
 			return skipspaces(exp+1);
 		}
 		exp++;
@@ -583,74 +558,80 @@ char *parse_rest(eval_t *ev, char *exp) {
 
 
 #define eval_defaults(ev) \
-	ev->from = gbl_current_node;\
-   	ev->to = NULL;
+	ev->from = gbl_current_line;\
+   	ev->to = gbl_current_line;\
+	ev->regex = NULL;
 
 eval_t *parse(eval_t *ev, char *exp) {
+	uint64_t start = STATS_START();
 	eval_defaults(ev);
 	exp = parse_address(ev, exp);
+	/* the lines addressed and one past them have to be loaded */
+	if (ev->addrs > 0)
+		ll_sync(ev->to + 2);
+	STATS_STOP(STAT_ADDRESS, start, 1, 0);
+	if (ev->from < 0 || ev->to > gbl_len || ev->from > ev->to) {
+		io_err("Invalid address\n");
+	}
+	/* the one command that is a word */
+	if (strcmp(exp, "stats") == 0) {
+		ev->cmd = STATSCMD;
+		ev->rest = exp + 5;
+		return ev;
+	}
 	ev->cmd = *exp++;
 	if (!iscommand(ev->cmd)) {
 		io_err("Unknown command: %s\n", exp);
 	}
-	ev->rest = parse_rest(ev, exp);
+	/* the default is the current line, only settled for those using it */
+	if (ev->addrs == 0 && strchr("acdijklmnpst#", ev->cmd))
+		ev->from = ev->to = current();
+	/* m and t take an address, which can have a /RE/ in it, and ! a
+	 * command, which can have anything */
+	if (ev->cmd == 'm' || ev->cmd == 't' || ev->cmd == '!')
+		ev->rest = exp;
+	else
+		ev->rest = parse_rest(ev, exp);
+	STATS_STOP(STAT_PARSE, start, 1, 0);
 	return ev;
 }
 
-node_t *ed_append(node_t * node) {
-	char *line = NULL;
-	size_t bytes = 0;
+long ed_append(long at) {
+	static _Thread_local char *line = NULL;
+	static _Thread_local size_t linecap = 0;
+	ssize_t bytes = 0;
 	size_t lines = 0;
-	size_t linecap;
-	while ((bytes = getline(&line, &linecap, stdin)) > 0) {
-		if (line[0] == '.')
+	while ((bytes = getline(&line, &linecap, io_input())) > 0) {
+		if (strcmp(line, ".\n") == 0)
 			break;
-		node = ll_add_node(node, line);
+		if (line[bytes-1] == '\n')
+			bytes--;
+		at = ll_add_node(at, line, bytes);
 		lines++;
-		bytes += bytes;
 	}
-	printf("%ld line%s appended\n", lines, (lines==1)?"":"s");
-	return gbl_current_node;
+	io_info("%ld line%s appended\n", lines, (lines==1)?"":"s");
+	return gbl_current_line;
 }
 
-node_t *ed_delete(node_t *from, node_t *to) {
-	while (from != to) {
-		from = ll_remove_node(from);
-	}
-	return from;
+long ed_delete(long from, long to) {
+	return ll_remove_range(from, to);
 }
 
-node_t * ed_change(node_t *from, node_t *to) {
-	node_t *start = ed_append(from);
-	return ed_delete(start->next, to);
+long ed_change(long from, long to) {
+	ed_delete(from, to);
+	return ed_append(from - 1);
 }
 
-void io_print_file(FILE *fp) {
-	char *line = NULL;
-	size_t linecap;
-	while (getline(&line, &linecap, fp) > 0) {
-		printf("%s", line);
-	}
-	free(line);
+void ed_shell(const char *cmd) {
+	pipe_run(cmd, 0, 0, NULL);
 }
 
-
-FILE * ed_shell(char *cmd, bool out) {
-	FILE *fp;
-	if ((fp = popen(cmd, "r")) == NULL) {
-		perror("popen");
-	}
-
-	state.fromfile = false;
-	state.cmd = cmd;
-	if (out) {
-		io_print_file(fp);
-		pclose(fp);
-		return NULL;
-	}
-	else {
-		return fp;
-	}
+/* the lines from `from` to `to` replaced by what `cmd` makes of them */
+void ed_filter(long from, long to, const char *cmd) {
+	size_t size;
+	char *buf = pipe_run(cmd, from, to, &size);
+	ll_remove_range(from, to);
+	io_add_text(from - 1, buf, size);
 }
 
 void ed_edit(char *filename, char *cmd, bool force) {
@@ -662,53 +643,33 @@ void ed_edit(char *filename, char *cmd, bool force) {
 	}
 
 	if (cmd != NULL) {
-		FILE *fp = ed_shell(cmd, false);
+		size_t size;
+		char *buf = pipe_run(cmd, 0, 0, &size);
 		state.fromfile = false;
 		state.cmd = cmd;
 		ll_free();
-		io_load_file(fp);
+		io_loaded(io_add_text(0, buf, size));
 		return;
 	}
 	else if (filename != NULL) {
 		ll_free();
-		state.filename = filename;
-		ed_save(state.filename, NULL, 0, 0);
 		io_load_file(fileopen(filename, "r"));
 		return;
 	}
 }
 
-node_t *ll_link_node(node_t *p, node_t *c, node_t *n) {
-	c->next = n;
-	c->prev = p;
-	n->prev = c;
-	p->next = c;
-	return c;
-}
 
 void ed_save(const char *filename, const char *cmd, bool quit, bool append) {
-	state.saved = true;	
 	if (filename != NULL) {
-		io_write_file(gbl_head_node, filename,(append)? "a":"w" );
+		/* a write that failed leaves the changes unsaved */
+		if (io_write_file(filename, (append)? "a":"w" ) == 0)
+			state.saved = true;
 		return;
 	}
 	else if (cmd != NULL) {
-		FILE *fp = popen(cmd, "w");
-		node_t *current = gbl_head_node;
-		while (current != NULL) {
-			fprintf(fp, "%s", current->s);
-			current = current->next;
-		}
-		char *line;
-		size_t linecap;
-		int bytes;
-		fflush(stdout);
-		printf("\n");
-		while ((bytes = getline(&line, &linecap, fp)) > 0) {
-			printf("%s", line);
-		}
-		fflush(stdout);
-		free(line);
+		/* what it prints goes straight to the editor's output */
+		pipe_run(cmd, 1, gbl_len, NULL);
+		state.saved = true;
 		return;
 	}
 
@@ -721,24 +682,46 @@ void ed_save(const char *filename, const char *cmd, bool quit, bool append) {
 	}
 }
 
-node_t * ed_copy(node_t *from, int to, node_t *at) {
-	while (to > 0 && from != NULL) {
-		at = ll_add_node(at, from->s);
-		from = from->next;
-		to--;
+/* the first line after the current one matching `pattern`, wrapping around */
+long ed_search(const char *pattern) {
+	ll_sync(LONG_MAX);
+	regbuf_t *rbuf = ll_reg_search(gbl_current_line + 1, gbl_len, pattern, 1);
+	if (rbuf->size == 0) {
+		ll_regbuf_free(rbuf);
+		rbuf = ll_reg_search(1, gbl_current_line, pattern, 1);
 	}
+	long at = (rbuf->size > 0) ? rbuf->buf[0] : 0;
+	ll_regbuf_free(rbuf);
+	if (at == 0)
+		io_err("No match\n");
 	return at;
 }
 
-node_t * ed_move(node_t *from, int to, node_t *at) {
-	ed_copy(from, to, at);
-	while (to > 0 && from != NULL) {
-		from = ll_remove_node(from);
-		to--;
-	}
-	return NULL;
+long parse_dest(char *s) {
+	eval_t dst;
+	eval_t *ev = &dst;
+	eval_defaults(ev);
+	char *end = skipspaces(parse_address(ev, skipspaces(s)));
+	ll_sync(ev->to + 2);
+	if (*end != '\0' || ev->to < 0 || ev->to > gbl_len)
+		io_err("Invalid destination\n");
+	return ev->to;
 }
 
+long ed_copy(long from, long to, long at) {
+	return ll_copy(from, to, at);
+}
+
+long ed_move(long from, long to, long at) {
+	if (at >= from && at < to)
+		io_err("Invalid destination\n");
+	return ll_move(from, to, at);
+}
+
+/* set in batch mode, where q ends a file's script rather than the editor */
+static bool batch;
+static _Thread_local bool quit;
+
 void ed_quit(bool force) {
 	if (!force) {
 		if (!state.saved) {
@@ -746,19 +729,29 @@ void ed_quit(bool force) {
 			return;
 		}
 	}
+	if (batch) {
+		quit = true;
+		return;
+	}
 	exit(EXIT_SUCCESS);
 }
 
 
+/* commands that work on lines can't take address 0 */
+#define needlines(ev) \
+	if ((ev)->from < 1) io_err("Invalid address\n");
+
 void eval(eval_t *ev) {
 	switch(ev->cmd) {
 		case 'a':
-			ed_append(ev->from);
+			ed_append(ev->to);
 			break;
 		case 'd':
+			needlines(ev);
 			ed_delete(ev->from, ev->to);
 			break;
 		case 'c':
+			needlines(ev);
 			ed_change(ev->from, ev->to);
 			break;
 		case 'e':
@@ -772,8 +765,10 @@ void eval(eval_t *ev) {
 			ed_edit(ev->rest, NULL, true);
 			break;
 		case 'w':
+			/* all of it is written whatever the addresses */
+			ll_sync(LONG_MAX);
 			if (ev->rest[0] == '!')
-				ed_save(NULL, nextword(ev->rest), 0, 0);
+				ed_save(NULL, skipspaces(ev->rest+1), 0, 0);
 			else if (ev->rest[0] == 'q')
 				ed_save(state.filename, NULL, 1, 0);
 			else if (isalnum(ev->rest[0]))
@@ -782,16 +777,29 @@ void eval(eval_t *ev) {
 				ed_save(state.filename, NULL, 0, 0);
 			break;
 		case 'W':
-			ed_save(ev->rest, NULL, 0, 1);
+			ll_sync(LONG_MAX);
+			ed_save((*ev->rest) ? ev->rest : state.filename, NULL, 0, 1);
 			break;
 		case 'p':
+			needlines(ev);
 			ed_print(ev->from, ev->to);
 			break;
 		case 'n':
+			needlines(ev);
 			ed_printn(ev->from, ev->to);
 			break;
+		case 'l':
+			needlines(ev);
+			ed_list(ev->from, ev->to);
+			break;
 		case '!':
-			ed_shell(ev->rest, true);
+			if (ev->addrs > 0) {
+				needlines(ev);
+				ed_filter(ev->from, ev->to, ev->rest);
+			}
+			else {
+				ed_shell(ev->rest);
+			}
 			break;
 		case 'q':
 			ed_quit(false);
@@ -799,266 +807,518 @@ void eval(eval_t *ev) {
 		case 'Q':
 			ed_quit(true);
 			break;
+		case 'u':
+			if (ll_undo() == -1)
+				io_err("Nothing to undo\n");
+			break;
+		case 'U':
+			if (ll_redo() == -1)
+				io_err("Nothing to redo\n");
+			break;
 		case 's':
+			needlines(ev);
 			ed_subs(ev->from, ev->to, ev->regex, ev->rest);
 			break;
+		case 'g':
+		case 'v':
+			/* the whole buffer by default */
+			if (ev->addrs == 0) {
+				ll_sync(LONG_MAX);
+				ev->from = 1;
+				ev->to = gbl_len;
+			}
+			if (gbl_len > 0) {
+				needlines(ev);
+				ed_global(ev->from, ev->to, ev->regex, ev->rest, ev->cmd == 'v');
+			}
+			break;
 		case 'k':
-			ed_mark(ev->from, ev->rest[0]);
+			needlines(ev);
+			ed_mark(ev->to, ev->rest[0]);
 			break;
 		case 'r':
+			/* reads go after the last line by default */
+			if (ev->addrs == 0) {
+				ll_sync(LONG_MAX);
+				ev->to = gbl_len;
+			}
 			if (ev->rest[0] == '!')
-				ed_read(NULL, nextword(ev->rest), ev->from);
+				ed_read(NULL, skipspaces(ev->rest+1), ev->to);
 			else
-				ed_read(ev->rest, NULL, ev->from);
+				ed_read(ev->rest, NULL, ev->to);
 			break;
 		case 'j':
-			ed_join(ev->from, ev->to);
+			needlines(ev);
+			/* joins the line after by default */
+			if (ev->addrs < 2)
+				ev->to = ev->from + 1;
+			if (ev->to <= gbl_len)
+				ed_join(ev->from, ev->to);
 			break;
 		case '=':
-			ed_equals(ev->from);
+			if (ev->addrs == 0) {
+				ll_sync(LONG_MAX);
+				ev->to = gbl_len;
+			}
+			ed_equals(ev->to);
 			break;
 		case '#':
 			ed_hash(ev->from);
 			break;
-		/* TODO: remove this temporary print func */
-		case 't': 
-			ll_print(gbl_head_node);
+		case 'm':
+			needlines(ev);
+			ed_move(ev->from, ev->to, parse_dest(ev->rest));
+			break;
+		case 't':
+			needlines(ev);
+			ed_copy(ev->from, ev->to, parse_dest(ev->rest));
+			break;
+		case STATSCMD:
+			if (!stats_on)
+				io_err("Stats are off, see -t\n");
+			out_flush();
+			stats_json(stdout);
 			break;
 		case '\n':
 			break;
 		default:
+			out_flush();
 			printf("Unimplemented Command\n");
 	}
 }
 
 
-/* 
- * Matches `reg` in `haystack`. Returns pointer to the match
- * and updates `matchsz` to be equal to the size of the 
- * matched substring
- * returns NULL if no match
+/* A replacement, parsed once per command into pieces of text and
+ * references to the match (&) or one of its subexpressions (\1 to \9).
  */
-char *strreg(char *haystack, regex_t *reg, int *matchsz) {
-	regmatch_t matcharr[1];	
-	if (regexec(reg, haystack, 1, matcharr, 0)) {
-		*matchsz = 0;
-		return NULL;
-	}
-	*matchsz = matcharr[0].rm_eo - matcharr[0].rm_so;
-	return haystack + matcharr[0].rm_so;
-}
-
-
-/* strncat(3) but returns pointer to the end */
-char *strncata(char *dest, char *src, int n) {
-	while (*dest) dest++;
-	while (n > 0) {
-		*dest++ = *src++;
-		--n;
+typedef struct {
+	struct piece {
+		const char *s;	/* text, or NULL for a reference */
+		size_t len;
+		int group;
+	} *pieces;
+	int n;
+	char *text;	/* the text pieces, unescaped */
+}tmpl_t;
+
+/* Growable output, kept from line to line */
+typedef struct {
+	char *buf;
+	size_t len, cap;
+}scratch_t;
+
+/* parse the replacement in the `len` bytes at `s` into `t` */
+void tmpl_parse(tmpl_t *t, const char *s, size_t len) {
+	/* every byte can be a piece at most */
+	if (!(t->pieces = malloc((len + 1) * sizeof(*t->pieces))) ||
+			!(t->text = malloc(len + 1))) {
+		free(t->pieces);
+		io_err("malloc: %s\n", strerror(errno));
 	}
-	return dest;
-}
-
-/*
- * `with` contains strings that may contain '&'s, which are placeholders
- * for mathced strings (see manual).
- * regcat() cats `dest` and `with` with '&'s in `with` replaced by `repstring`
- */
-char * regcat(char *dest, char *with, char *repstring, int *substrsizes) {
-	while (*dest) dest++;
-
-	for (int i = 0; *with; ) {
-		if (*with == '&') {
-			if (*(with-1) != '\\') {
-				dest = strncata(dest, repstring, substrsizes[i]);
-				with++;
-				i++;
-				continue;
-			}
-			else {
-				dest--;
-				*dest = '&';
-			}
+	t->n = 0;
+	char *text = t->text;
+	struct piece *last = NULL;
+	for (const char *end = s + len; s < end; ++s) {
+		int group = -1;
+		if (*s == '&')
+			group = 0;
+		else if (*s == '\\' && s + 1 < end && s[1] >= '1' && s[1] <= '9')
+			group = *++s - '0';
+		else if (*s == '\\' && s + 1 < end)
+			s++;
+
+		if (group != -1) {
+			last = &t->pieces[t->n++];
+			*last = (struct piece) { .s = NULL, .group = group };
+			continue;
 		}
-		else {
-			*dest = *with;
+		/* runs of text go in one piece */
+		if (last == NULL || last->s == NULL) {
+			last = &t->pieces[t->n++];
+			*last = (struct piece) { .s = text, .len = 0 };
 		}
-
-		dest++;
-		with++;
+		*text++ = *s;
+		last->len++;
 	}
-	return dest;
 }
 
-
-/* 
- * Count the number of unescaped chars in a string 
- * also store the size of the string without unescaped
- * chars in sz
- */
-int countchars(char *s, char n, int *sz) {
-	int count = 0;
-	*sz = 0;
-	while (*s) {
-		if (*s == n) { 
-			if (*(s-1) != '\\') 
-				count++;
-		}
-		else {
-			*sz += 1;
-		}
-		s++;
-	}
-	return count;
+void tmpl_free(tmpl_t *t) {
+	free(t->pieces);
+	free(t->text);
 }
 
-
-/* Return the total sum of sizes of each substring replaced */
-int rep_substr_sz(char *substr, int *substrsizes, int totalreps) {
-	int size = 0;
-	
-	int remsize = 0;
-	int namps = countchars(substr, '&', &remsize);
-	for (int i = 0; i < totalreps; ++i) {
-		size += (namps * substrsizes[i]) + remsize;
-	}
-	return size;
+/* make room for `len` more bytes in `out`, false if there is no memory */
+static bool scratch_grow(scratch_t *out, size_t len) {
+	if (out->cap - out->len >= len)
+		return true;
+	size_t cap = out->cap * 2 + len + 4096;
+	char *buf = realloc(out->buf, cap);
+	if (buf == NULL)
+		return false;
+	out->buf = buf;
+	out->cap = cap;
+	return true;
 }
 
-
+static bool scratch_put(scratch_t *out, const char *s, size_t len) {
+	if (len == 0)
+		return true;
+	if (!scratch_grow(out, len))
+		return false;
+	memcpy(out->buf + out->len, s, len);
+	out->len += len;
+	return true;
+}
 
 /*
- * Replace `rep` with `with` in `str`. 
- * `matchall`, if true will replace all matches in str.
- * Returns an allocated string, must be freed by the user.
+ * Replace matches of `re` in the `strsz` bytes at `str` with `with`, the
+ * first one or with `matchall` all of them, in one pass. The result is
+ * appended to `out`. Returns 1 if anything was replaced, 0 if nothing
+ * matched (and `out` is untouched) or -1 if there was no memory. It
+ * doesn't longjmp(), the pool's workers call it.
  */
-char *strrep(char *str, regex_t *rep, char *with, bool matchall) {
-	/* Replacement happens in two passes over `str`
-	 * first pass: mark what has to be replaced
-	 * second pass: replace
-	 */
-
-	int strsz = strlen(str);
-	char *strstart = str;
-	char *strend = str + strsz;
-
-	/* Store pointers to substrings that will be replaced */
-	char *reparr[REPLIM];
-	/* Number of replacements */
-	int totalreps;
-
-	/* Store the size of each substring that will be replaced */
-	int substrsizes[REPLIM];
-	/* Sum of the above array */
-	int repsum = 0;
-
-	
-	/* Pass 1 */
-	for (int i = 0,repsz = 0; str < strend; ++i) {
-		if ((str = reparr[i] = strreg(str, rep, &repsz)) == NULL) {
-			totalreps = i;
+int strrep(const char *str, size_t strsz, const re_t *re, const tmpl_t *with,
+		bool matchall, scratch_t *out) {
+	regmatch_t m[10];
+	size_t start = out->len;
+	size_t pos = 0;	/* everything before this is in `out` */
+	size_t from = 0;	/* where to look for the next match */
+	bool matched = false;
+
+	while (from <= strsz) {
+		m[0].rm_so = from;
+		m[0].rm_eo = strsz;
+		/* only the start of the line is the start of the line */
+		if (re_exec(re, str, 10, m, (from > 0) ? REG_NOTBOL : 0) != 0)
 			break;
+		/* an empty match right after the last match isn't one */
+		if (matched && m[0].rm_so == m[0].rm_eo && (size_t) m[0].rm_so == pos) {
+			from = m[0].rm_so + 1;
+			continue;
 		}
-		str += repsz;
-		totalreps = i;
-		substrsizes[i] = repsz;
-		repsum += substrsizes[i];
-
+		matched = true;
+
+		if (!scratch_put(out, str + pos, m[0].rm_so - pos))
+			goto fail;
+		for (int i = 0; i < with->n; ++i) {
+			const struct piece *p = &with->pieces[i];
+			const char *s = p->s;
+			size_t len = p->len;
+			if (s == NULL) {
+				if (m[p->group].rm_so == -1)
+					continue;
+				s = str + m[p->group].rm_so;
+				len = m[p->group].rm_eo - m[p->group].rm_so;
+			}
+			if (!scratch_put(out, s, len))
+				goto fail;
+		}
+		pos = m[0].rm_eo;
+		from = (m[0].rm_so == m[0].rm_eo) ? pos + 1 : pos;
 		if (!matchall)
 			break;
 	}
+	if (!matched)
+		return 0;
+	if (!scratch_put(out, str + pos, strsz - pos))
+		goto fail;
+	return 1;
+fail:
+	out->len = start;
+	return -1;
+}
 
-	if (totalreps == 0)
-		return strstart;
-
-	int repsubstrsz = rep_substr_sz(with, substrsizes, totalreps);
+/* ranges shorter than this are substituted on one thread */
+#define SUBSMIN 16384
 
-	/* retn will be the replaced string and retnsz its size */
-	int retnsz = strsz + (repsubstrsz - repsum);
-	char *retn; 
-	if (!(retn = calloc(retnsz, sizeof(*retn)))) {
-		io_err("calloc: %s", strerror(errno));
+/* A substitution split over the pool. Every part puts the new text of
+ * the lines it changed one after the other in `text`, the buffer is
+ * only touched once all of them are done.
+ */
+struct subs {
+	buffer_t *buffer;	/* the lines are its */
+	const char *pattern;
+	const tmpl_t *with;
+	bool matchall;
+	long from, to;
+	int parts;
+	struct subs_part {
+		long *lines;	/* the lines that changed */
+		size_t *lens;	/* and the length of their new text */
+		long n, cap;
+		scratch_t text;
+		bool failed;
+	} *res;
+};
+
+static bool subs_push(struct subs_part *p, long at, size_t len) {
+	if (p->n == p->cap) {
+		long cap = p->cap * 2 + 64;
+		long *lines = realloc(p->lines, cap * sizeof(long));
+		if (lines != NULL)
+			p->lines = lines;
+		size_t *lens = realloc(p->lens, cap * sizeof(size_t));
+		if (lens != NULL)
+			p->lens = lens;
+		if (lines == NULL || lens == NULL)
+			return false;
+		p->cap = cap;
 	}
+	p->lines[p->n] = at;
+	p->lens[p->n++] = len;
+	return true;
+}
 
-	char *sretn = retn;
+static void subs_part(void *arg, int i) {
+	struct subs *sb = arg;
+	struct subs_part *p = &sb->res[i];
+	long from, to;
 
-	/* pass 2 */
-	str = strstart;
-	for (int i = 0; str < strend; ) {
-		if (str == reparr[i]) {
-			retn = regcat(retn, with, reparr[i], substrsizes);
-			str += substrsizes[i];
-			++i;
+	ll_buffer_use(sb->buffer);
+	pool_slice(sb->from, sb->to, sb->parts, i, &from, &to);
+	re_t *re = re_compile(sb->pattern, REG_EXTENDED);
+	if (re == NULL) {
+		p->failed = true;
+		return;
+	}
+	uint64_t start = STATS_START();
+	long first = from;
+	size_t bytes = 0;
+	ll_iter_t it;
+	node_t *current = ll_iter_at(&it, from);
+	for (; from <= to; ++from, current = ll_iter_next(&it)) {
+		size_t len = p->text.len;
+		bytes += current->len;
+		int r = strrep(current->s, current->len, re, sb->with, sb->matchall, &p->text);
+		if (r == 0)
 			continue;
+		if (r == -1 || !subs_push(p, from, p->text.len - len)) {
+			p->failed = true;
+			break;
 		}
-		*retn= *str;
-		retn++;
-		str++;
 	}
-	free(strstart);
-	return sretn;
+	STATS_STOP(STAT_SUBST, start, from - first, bytes);
+	STATS_STOP(STAT_REGEXEC, start, from - first, bytes);
 }
 
-
-
-/* :(.,.)s/^regx$/replace/g */
-void ed_subs(node_t *from, node_t *to, const char *regex, char *rest) {
-	char *srest = rest;
-	while (*rest != '/') { 
-		rest++; 
+/* :(.,.)s/^regx$/replace/g, a bare s repeats the last one */
+void ed_subs(long from, long to, const char *regex, char *rest) {
+	if (regex == NULL) {
+		if (*rest != '\0')
+			io_err("Invalid command suffix\n");
+		if (state.replace == NULL)
+			io_err("No previous substitution\n");
+		rest = state.replace;
 	}
-	*rest = '\0'; rest++;
+	char *srest = rest;
+	rest = finddelim(rest);
+	size_t withlen = rest - srest;
+	if (*rest != '\0')
+		rest++;
 	rest = skipspaces(rest);
 	bool flag = false;
 	if (*rest == 'g')
 		flag = true;
 
-	regex_t reg;
-	int ret;
-	if ((ret = regcomp(&reg, regex, REG_EXTENDED)) != 0) {
-		io_reg_err(&reg, ret);
+	/* compiled here first so errors are reported, the workers
+	 * compile their own from it
+	 */
+	re_get(regex, REG_EXTENDED);
+	/* what a bare s repeats */
+	if (regex != NULL) {
+		char *replace = strdup(srest);
+		if (replace == NULL)
+			io_err("strdup: %s\n", strerror(errno));
+		free(state.replace);
+		state.replace = replace;
+	}
+	tmpl_t with;
+	tmpl_parse(&with, srest, withlen);
+	struct subs sb = {
+		.buffer = gbl_buffer,
+		.pattern = re_last(),
+		.with = &with,
+		.matchall = flag,
+		.from = from,
+		.to = to,
+		.parts = pool_parts(to - from + 1, SUBSMIN),
+	};
+	if (!(sb.res = calloc(sb.parts, sizeof(*sb.res)))) {
+		tmpl_free(&with);
+		io_err("calloc: %s\n", strerror(errno));
 	}
+	pool_run(sb.parts, subs_part, &sb);
+	tmpl_free(&with);
 
-	while (from != to) {
-		from->s = strrep(from->s, &reg, srest, flag);
-		from = from->next;
+	bool failed = false;
+	for (int i = 0; i < sb.parts; ++i)
+		failed |= sb.res[i].failed;
+
+	/* splice the new text in, in order; only lines that matched
+	 * get a copy of their own
+	 */
+	for (int i = 0; i < sb.parts; ++i) {
+		struct subs_part *p = &sb.res[i];
+		if (!failed && p->n > 0) {
+			/* the text moves into the arena as it is, less the
+			 * room it had to grow
+			 */
+			char *s = p->text.buf;
+			if (p->text.len > 0 && (s = realloc(s, p->text.len)) == NULL)
+				s = p->text.buf;
+			ll_adopt(s, p->text.len);
+			p->text.buf = NULL;
+			ll_iter_t it;
+			node_t *current = ll_iter_at(&it, p->lines[0]);
+			for (long k = 0, at = p->lines[0]; k < p->n; ++k) {
+				/* step over short gaps, look far ones up */
+				if (p->lines[k] - at > CHUNKLIM) {
+					at = p->lines[k];
+					current = ll_iter_at(&it, at);
+				}
+				for (; at < p->lines[k]; ++at)
+					current = ll_iter_next(&it);
+				ll_node_set(at, current, s, p->lens[k]);
+				s += p->lens[k];
+			}
+		}
+		free(p->lines);
+		free(p->lens);
+		free(p->text.buf);
 	}
+	free(sb.res);
+	if (failed)
+		io_err("Out of memory\n");
 }
 
-void ed_print(node_t *from, node_t *to) {
-	fflush(stdout);
-	while (from != to) {
-		printf("%s", from->s);
-		from = from->next;
+/* set while a command list runs, g doesn't nest */
+static _Thread_local bool inglobal;
+
+/* Run the command list `cmds` on the lines from `from` to `to` matching
+ * `regex`, or not matching it with `invert`. All of them are marked in
+ * one search first and the list then runs on each marked line that is
+ * still there, in order, so a line removed by the list is skipped rather
+ * than looked for. Lines of the list end in a backslash when another
+ * one follows; an empty list prints.
+ */
+void ed_global(long from, long to, const char *regex, char *cmds, bool invert) {
+	if (inglobal)
+		io_err("Cannot nest global commands\n");
+	if (regex == NULL)
+		io_err("No regular expression\n");
+	regbuf_t *rbuf = ll_reg_search(from, to, regex, 0);
+	ll_gmark(from, to, rbuf->buf, rbuf->size, invert);
+	ll_regbuf_free(rbuf);
+
+	char *list = strdup((*cmds) ? cmds : "p");
+	size_t len = (list) ? strlen(list) : 0;
+	while (list != NULL && len > 0 && list[len-1] == '\\') {
+		char *line = io_read_line(NULL);
+		if (line == NULL)
+			break;
+		list[len-1] = '\n';
+		char *more = realloc(list, len + strlen(line) + 1);
+		if (more != NULL)
+			strcpy(more + len, line);
+		list = more;
+		len = (list) ? len + strlen(line) : 0;
 	}
-	gbl_current_node = (from) ? from : gbl_tail_node;
+	/* parse() writes into the command it is given, so every line
+	 * gets a copy of it
+	 */
+	char *buf = malloc(len + 1);
+	if (list == NULL || buf == NULL) {
+		free(list);
+		free(buf);
+		ll_gclear();
+		io_err("Out of memory\n");
+	}
+
+	jmp_buf outer;
+	memcpy(outer, torepl, sizeof(jmp_buf));
+	inglobal = true;
+	if (setjmp(torepl) != 0) {
+		/* an error ends the whole command */
+		ll_gclear();
+		inglobal = false;
+		free(list);
+		free(buf);
+		memcpy(torepl, outer, sizeof(jmp_buf));
+		longjmp(torepl, 1);
+	}
+
+	eval_t ev;
+	long at;
+	while ((at = ll_gnext()) != 0) {
+		gbl_current_line = at;
+		for (char *p = list, *end; ; p = end + 1) {
+			end = strchr(p, '\n');
+			size_t n = (end) ? (size_t) (end - p) : strlen(p);
+			memcpy(buf, p, n);
+			buf[n] = '\0';
+			eval(parse(&ev, buf));
+			if (end == NULL)
+				break;
+		}
+	}
+	inglobal = false;
+	free(list);
+	free(buf);
+	memcpy(torepl, outer, sizeof(jmp_buf));
 }
 
-void ed_printn(node_t *from, node_t *to) {
-	for (int i = 1; from != to; ++i, from = from->next) {
-		printf("%-5d%c%s", i, ' ', from->s);
+void ed_print(long from, long to) {
+	ll_iter_t it;
+	node_t *current = ll_iter_at(&it, from);
+	for (; from <= to; ++from, current = ll_iter_next(&it))
+		out_line(current->s, current->len);
+	out_done();
+	gbl_current_line = to;
+}
+
+void ed_printn(long from, long to) {
+	ll_iter_t it;
+	node_t *current = ll_iter_at(&it, from);
+	/* the list is addressed by number, the iterator's line is its number */
+	for (; from <= to; ++from, current = ll_iter_next(&it)) {
+		out_number(from, 0);
+		out_char('\t');
+		out_line(current->s, current->len);
 	}
-	gbl_current_node = (from) ? from : gbl_tail_node;
+	out_done();
+	gbl_current_line = to;
 }
 
-void ed_mark(node_t *node, int mark) {
+void ed_list(long from, long to) {
+	ll_iter_t it;
+	node_t *current = ll_iter_at(&it, from);
+	for (; from <= to; ++from, current = ll_iter_next(&it))
+		out_list(current->s, current->len);
+	out_done();
+	gbl_current_line = to;
+}
+
+void ed_mark(long at, int mark) {
 	if (mark < '!' || mark > '~')
 		io_err("Unacceptable or missing Mark\n");
-	markset(node, mark);
-	printf("Mark set at \"%c\"", mark);
+	markset(at, mark);
+	io_info("Mark set at \"%c\"", mark);
 }
 
-void ed_read(const char *filename, const char *cmd, node_t *from) {
-	FILE *fp;
-	fp = (filename)? fileopen(filename, "r"): popen(cmd, "r");
-
-	char *line = NULL;
-	size_t linecap;
-	while (getline(&line, &linecap, fp) > 0) {
-		from = ll_add_node(from, line);
+void ed_read(const char *filename, const char *cmd, long at) {
+	size_t size;
+	if (cmd != NULL) {
+		char *buf = pipe_run(cmd, 0, 0, &size);
+		io_add_text(at, buf, size);
+		return;
 	}
-
-	(filename)? fclose(fp): pclose(fp);
+	FILE *fp = fileopen(filename, "r");
+	if (fp == NULL)
+		return;
+	char *buf = io_read_all(fp, &size);
+	ll_add_lines(at, buf, size, true);
+	free(buf);
+	fclose(fp);
 }
 
 char *strcata(char *dest, char *src) {
@@ -1067,49 +1327,42 @@ char *strcata(char *dest, char *src) {
 	return --dest;
 }
 
-void ed_equals(node_t *from) {
-	printf("%s", from->s);
+void ed_equals(long at) {
+	out_number(at, 0);
+	out_char('\n');
 }
 
-void ed_hash(node_t *from) {
-	gbl_current_node = from;
+void ed_hash(long at) {
+	gbl_current_line = at;
 }
 
-char *joincat(char *dest, char *s) {
-	while ((*dest++ = *s++));
-
-	if (*(dest - 2) == '\n')
-		dest -= 2;
-	else
-		dest -= 1;
-
-	return dest;
-}	
-
-void ed_join(node_t *from, node_t *to) {
-	int total_size = 0;
-	node_t *current = from;
-	while (current != to) {
-		total_size += strlen(current->s);
-		current = current->next;
+void ed_join(long from, long to) {
+	/* a line joined to itself is left alone, undo included */
+	if (from == to)
+		return;
+	size_t total_size = 0;
+	ll_iter_t it;
+	node_t *current = ll_iter_at(&it, from);
+	for (long i = from; i <= to; ++i, current = ll_iter_next(&it)) {
+		total_size += current->len;
 	}
 	
-	char *new = calloc(total_size, sizeof(char));
+	char *new = ll_alloc(total_size);
 	char *snew = new;
-	new = joincat(new, from->s);
-	free(from->s);
-	from->s = snew;
-
-	current = from->next;
-
-	while (current != to) {
-		new = joincat(new, current->s);
-		current = ll_remove_node(current);
+	current = ll_iter_at(&it, from);
+	for (long i = from; i <= to; ++i, current = ll_iter_next(&it)) {
+		memcpy(new, current->s, current->len);
+		new += current->len;
 	}
+
+	ll_replace(from, snew, total_size);
+	ll_remove_range(from + 1, to);
+	gbl_current_line = from;
 }
 
 
 void io_err(const char *fmt, ...) {
+	out_flush();
 	va_list ap;
 	va_start(ap, fmt);
 	vfprintf(stderr, fmt, ap);
@@ -1118,32 +1371,227 @@ void io_err(const char *fmt, ...) {
 	return;
 }
 
+void io_info(const char *fmt, ...) {
+	if (state.script)
+		return;
+	out_flush();
+	va_list ap;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+/* commands run by repl(), over every thread, and when the editor started */
+static atomic_long ncommands;
+static struct timespec started;
+/* errors of the commands the calling thread's repl() ran */
+static _Thread_local long errors;
+
+/* how fast a script went, on stderr so its output stays its own */
+static void script_stats() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double secs = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+	out_flush();
+	long n = atomic_load(&ncommands);
+	fprintf(stderr, "%ld commands in %.3f s, %.0f commands/s\n", n, secs,
+			(secs > 0) ? n / secs : 0);
+}
+
 void repl() {
 	char *line = NULL;
 	eval_t ev;
-	setjmp(torepl);
-	while ((line = io_read_line(EDPROMPT)) != NULL) {
-		eval(parse(&ev, line));
+	if (setjmp(torepl) != 0)
+		errors++;
+	while (!quit && (line = io_read_line(EDPROMPT)) != NULL) {
+		ncommands++;
+		/* every command is one step to undo */
+		ll_step();
+		/* whatever the loader has read by now */
+		ll_sync(0);
+		parse(&ev, line);
+		uint64_t start = STATS_START();
+		eval(&ev);
+		if (stats_on && ev.cmd != STATSCMD)
+			stats_command(ev.cmd, stats_now() - start);
+	}
+}
+
+/* Batch mode (-x): a script run on every one of a list of files, each
+ * file as `ed -s file < script` would take it, in a buffer of its own.
+ * The files are the tasks of a pool job, so they are edited a thread's
+ * worth at a time, and the searches and substitutions of a file run in
+ * its thread rather than being split over the pool again. Its output
+ * comes out in one piece when its script ends, unless there is more of
+ * it than OUTBUF.
+ */
+struct batch {
+	buffer_t *editor;	/* the editor's buffer, with the options */
+	char *script;
+	size_t size;
+	char **files;
+	atomic_int failed;	/* files with errors */
+};
+
+static void batch_file(void *arg, int i) {
+	struct batch *bt = arg;
+	const char *filename = bt->files[i];
+	ll_buffer_use(bt->editor);
+	buffer_t *b = ll_buffer_new();
+	FILE *in = (b != NULL) ? fmemopen(bt->script, bt->size, "r") : NULL;
+	if (in == NULL) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		if (b != NULL)
+			ll_buffer_free(b);
+		atomic_fetch_add(&bt->failed, 1);
+		return;
+	}
+
+	ll_buffer_use(b);
+	input = in;
+	quit = false;
+	errors = 0;
+	if (setjmp(torepl) == 0) {
+		FILE *fp = fileopen(filename, "r");
+		if (fp == NULL && errno != ENOENT) {
+			errors++;
+		}
+		else {
+			io_load_file(fp);
+			repl();
+		}
+	}
+	else {
+		errors++;
+	}
+	out_flush();
+	input = NULL;
+	fclose(in);
+	ll_buffer_use(bt->editor);
+	ll_buffer_free(b);
+	if (errors > 0) {
+		fprintf(stderr, "%s: %ld error%s\n", filename, errors, (errors == 1) ? "" : "s");
+		atomic_fetch_add(&bt->failed, 1);
+	}
+}
+
+int ed_batch(const char *path, int n, char **files) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		die((char *) path, NULL);
+	if (setjmp(torepl) != 0)
+		exit(EXIT_FAILURE);
+	struct batch bt = { .editor = gbl_buffer, .files = files };
+	bt.script = io_read_all(fp, &bt.size);
+	fclose(fp);
+	batch = true;
+	state.script = true;
+	pool_run(n, batch_file, &bt);
+	free(bt.script);
+	return (atomic_load(&bt.failed) > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* where -T writes the stats on exit */
+static const char *statsfile;
+
+static void stats_dump() {
+	FILE *fp = fopen(statsfile, "w");
+	if (fp == NULL) {
+		perror(statsfile);
+		return;
 	}
-	free(line);
+	stats_json(fp);
+	fclose(fp);
 }
 
 void usage() {
 	printf("Usage:\n"
-		   "ed [file]\n");
+		   "ed [-bfpst] [-S script] [-T file] [-j threads] [-m MB] [-u MB] [file]\n"
+		   "ed -x script [-fpt] [-T file] [-j threads] [-m MB] [-u MB] file...\n"
+		   "  -b  load files in the background, the prompt comes first\n"
+		   "  -f  fsync files when writing them\n"
+		   "  -p  patch the file in place when only parts of it changed\n"
+		   "  -s  run a script from stdin: no prompts or counts, buffered\n"
+		   "      output and the commands per second on exit\n"
+		   "  -S  the same with the script in a file\n"
+		   "  -x  run the script in this file on every file given, each in a\n"
+		   "      buffer of its own, the files spread over the threads\n"
+		   "  -t  time commands and count what they do, see the stats command\n"
+		   "  -T  the same, and write the stats to this file as JSON on exit\n"
+		   "  -j  threads for searching, one per CPU by default\n"
+		   "  -m  page files bigger than this, 1024 by default, 0 pages all\n"
+		   "  -u  memory for undo, 512 MB by default, 0 turns it off\n");
 }
 
 int main (int argc, char *argv[]) {
-	if (argc < 2) {
+	int opt;
+	const char *batchscript = NULL;
+	while ((opt = getopt(argc, argv, "bfpsS:tT:j:m:u:x:")) != -1) {
+		switch (opt) {
+			case 'b':
+				ll_background(true);
+				break;
+			case 'f':
+				state.sync = true;
+				break;
+			case 'p':
+				state.patch = true;
+				break;
+			case 'S':
+				if (freopen(optarg, "r", stdin) == NULL)
+					die("freopen", NULL);
+				/* fall through */
+			case 's':
+				state.script = true;
+				break;
+			case 'x':
+				batchscript = optarg;
+				state.script = true;
+				break;
+			case 'T':
+				statsfile = optarg;
+				/* fall through */
+			case 't':
+				stats_on = true;
+				break;
+			case 'j':
+				pool_init(atoi(optarg));
+				break;
+			case 'm':
+				ll_page_limit((size_t) atol(optarg) << 20);
+				break;
+			case 'u':
+				ll_journal_limit((size_t) atol(optarg) << 20);
+				break;
+			default:
+				usage();
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (optind >= argc) {
 		fprintf(stderr, "Too few arguments\n");
 		usage();
 		exit(EXIT_FAILURE);
 	}
 	atexit(ll_free);
+	atexit(re_free);
+	atexit(out_flush);
+	if (statsfile != NULL)
+		atexit(stats_dump);
+	if (state.script) {
+		/* scripts come and go in big blocks rather than lines */
+		setvbuf(stdin, NULL, _IOFBF, 1 << 20);
+		setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+		atexit(script_stats);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	if (batchscript != NULL)
+		return ed_batch(batchscript, argc - optind, argv + optind);
 	FILE *fp = NULL;
-	if ((fp = fileopen(argv[1], "r")) == NULL && errno != ENOENT) {
+	if ((fp = fileopen(argv[optind], "r")) == NULL && errno != ENOENT) {
 		die("fileopen", NULL);
 	}
 	io_load_file(fp);
 	repl();	
+	return EXIT_SUCCESS;
 }
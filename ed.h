@@ -0,0 +1,48 @@
+#ifndef ED_H
+#define ED_H
+
+#include <stdbool.h>
+#include <setjmp.h>
+#include <regex.h>
+
+/* Definitions shared between the editor (ed.c) and the buffer (ll.c) */
+
+/* where errors go, every thread running commands has its own */
+extern _Thread_local jmp_buf torepl;
+
+struct state {
+	char *filename;	/* a copy of its own, see io_set_filename() */
+	bool saved;
+	char *cmd;
+	bool fromfile;
+	bool sync;	/* fsync() files when writing them */
+	bool patch;	/* write only what changed into the file loaded */
+	bool script;	/* no prompts or counts, see -s */
+	char *pattern;	/* the last regular expression, see re_get() */
+	char *replace;	/* the last s's template and flags, for a bare s */
+};
+
+/* A buffer: its lines and the state of editing them. Every thread works
+ * on a current buffer of its own, gbl_buffer, and the list's globals
+ * (gbl_len, gbl_current_line) and `state` are that buffer's fields. The
+ * rest of it is ll.c's, see ll_buffer_new().
+ */
+typedef struct buffer {
+	long len;
+	long current_line;
+	struct state st;	/* `state` while it is current */
+	struct list *list;
+}buffer_t;
+
+extern _Thread_local buffer_t *gbl_buffer;
+
+#define state (gbl_buffer->st)
+
+void die(char *fn, char *cause);
+/* longjmp() to repl() */
+void io_err(const char *fmt, ...);
+/* counts and other chatter, which scripts go without */
+void io_info(const char *fmt, ...);
+void io_reg_err(regex_t *regcmp, int errcode);
+
+#endif
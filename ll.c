@@ -0,0 +1,2376 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <regex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "ed.h"
+#include "ll.h"
+#include "scan.h"
+#include "re.h"
+#include "pool.h"
+#include "stats.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct chunk {
+	struct chunk *left;
+	struct chunk *right;
+	struct chunk *parent;
+	uint32_t prio;
+	long weight;	/* lines in this subtree */
+	int n;		/* lines in this chunk */
+	int ngmark;	/* lines in this chunk marked for g */
+	long gmarks;	/* marked lines in this subtree */
+	uint64_t gmark[CHUNKLIM / 64];	/* a bit per line, none past `n` */
+	/* A page: `n` lines of the mapped file, its `pagesz` bytes at `page`
+	 * in order, without nodes. NULL for a chunk of nodes.
+	 */
+	const char *page;
+	size_t pagesz;
+	node_t lines[];	/* CHUNKLIM of them, none in a page */
+};
+
+/* Files bigger than gbl_pagelimit are not indexed a line at a time but
+ * a page of about PAGESZ bytes at a time, which is all the memory they
+ * take until a page has to be turned into nodes to change its lines.
+ * Reading a page's lines walks its newlines, the mapping loads it on
+ * demand and the kernel is free to drop it again.
+ */
+#define PAGESZ (1 << 20)
+static size_t gbl_pagelimit = (size_t) 1 << 30;
+
+/* Chunks come out of slabs through a free list and line text is bumped
+ * out of large blocks. Text is never given back a line at a time: what a
+ * line stops using stays in its block (much like ed's scratch file) and
+ * ll_free() releases the whole arena a slab and a block at a time.
+ */
+#define SLABLIM 64		/* chunks per slab */
+#define BLOCKSZ (1 << 20)	/* bytes per text block */
+#define CHUNKSZ (sizeof(chunk_t) + CHUNKLIM * sizeof(node_t))
+
+typedef struct slab {
+	struct slab *next;
+	char mem[];	/* SLABLIM chunks */
+}slab_t;
+
+/* slabs of chunks of one size, pages have no nodes and are smaller */
+typedef struct {
+	slab_t *slabs;
+	int used;		/* chunks handed out of the newest slab */
+	chunk_t *free;		/* linked through ->left */
+}slabs_t;
+
+typedef struct block {
+	struct block *next;
+	size_t used;
+	size_t size;
+	char *data;	/* right behind the header unless adopted */
+}block_t;
+
+typedef struct {
+	slabs_t chunks;
+	slabs_t pages;
+	block_t *blocks;
+	jmp_buf *oom;	/* where slab_get() goes without memory, NULL to io_err() */
+}arena_t;
+
+/* The undo journal, described with its functions below */
+typedef struct {
+	char op;	/* 'd' remove lines, 'a' put `nodes` back, 's' swap `nodes` in,
+			 * 'm' move lines back after line `to` */
+	long at, n, cap;
+	long to;
+	long *lines;	/* for 's', the line of every node, ascending */
+	node_t *nodes;
+}jrec_t;
+
+typedef struct {
+	jrec_t *recs;
+	long n, cap;
+	long line;	/* the current line before the step */
+}jstep_t;
+
+typedef struct {
+	jstep_t *undo, *redo;	/* oldest first */
+	long nundo, nredo, capundo, capredo;
+	size_t bytes;		/* held by the records of both */
+	size_t limit;
+	bool open;		/* changes go into the last undo step */
+	bool replaying;		/* undoing or redoing, don't record */
+	bool off;		/* the open step outgrew the limit */
+}journal_t;
+
+/* A file loaded in the background, see loader_start() */
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* a block was handed over or it is done */
+	bool running;		/* there is a thread to join */
+	bool paged;
+	const char *from, *to;	/* what the loader reads */
+	arena_t arena;
+	/* under the lock */
+	chunk_t *list;		/* read and not taken yet */
+	long lines, pages;
+	bool stop;		/* asked to give up */
+	bool done;
+	bool failed;		/* out of memory */
+}loader_t;
+
+/* how a target takes copies of the mapped file, from the first way down
+ * as they fail
+ */
+typedef enum { COPY_RANGE, COPY_SPLICE, COPY_NONE } copying_t;
+
+/* The list of a buffer and all that goes with it, which buffer_t leaves
+ * to this file. The code below reaches the calling thread's current one
+ * through the gbl_ names, as when there was only one list in memory.
+ */
+struct list {
+	chunk_t *root;
+
+	/* The file the list was loaded from. Lines not changed since loading
+	 * are views into this mapping rather than copies.
+	 */
+	char *map;
+	size_t maplen;
+	dev_t mapdev;
+	ino_t mapino;
+	/* the file itself, unchanged pages are copied out of it when written */
+	int mapfd;
+	/* its size and time of change as last loaded or patched */
+	off_t filesize;
+	struct timespec filetime;
+	/* tells the mapping's pages apart from every other one's */
+	unsigned long mapgen;
+
+	long pages;		/* page chunks in the list */
+	/* bumped when pages are turned into nodes, iterators find their line
+	 * again when it changes
+	 */
+	unsigned long gen;
+
+	arena_t arena;
+	long marks[MARKLIM];
+	journal_t journal;
+	ll_wstat_t wstat;	/* what the last ll_write() or ll_patch() did */
+	copying_t copying;
+	loader_t loader;
+};
+
+/* the buffer there is from the start, every thread begins with it */
+static struct list gbl_firstlist = {
+	.mapfd = -1,
+	.journal = { .limit = (size_t) 512 << 20 },
+	.loader = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	},
+};
+static buffer_t gbl_first = { .list = &gbl_firstlist };
+
+_Thread_local buffer_t *gbl_buffer = &gbl_first;
+static _Thread_local struct list *gbl_list = &gbl_firstlist;
+/* where the calling thread takes chunks from, the loader has slabs of its own */
+static _Thread_local arena_t *arena = &gbl_firstlist.arena;
+
+/* every mapping takes the next one */
+static atomic_ulong gbl_mapgens;
+
+#define gbl_root (gbl_list->root)
+#define gbl_map (gbl_list->map)
+#define gbl_maplen (gbl_list->maplen)
+#define gbl_mapdev (gbl_list->mapdev)
+#define gbl_mapino (gbl_list->mapino)
+#define gbl_mapfd (gbl_list->mapfd)
+#define gbl_filesize (gbl_list->filesize)
+#define gbl_filetime (gbl_list->filetime)
+#define gbl_mapgen (gbl_list->mapgen)
+#define gbl_pages (gbl_list->pages)
+#define gbl_gen (gbl_list->gen)
+#define gbl_arena (gbl_list->arena)
+#define gbl_marks (gbl_list->marks)
+#define gbl_journal (gbl_list->journal)
+#define gbl_wstat (gbl_list->wstat)
+#define gbl_copying (gbl_list->copying)
+#define gbl_loader (gbl_list->loader)
+
+#define isview(node) \
+	((uintptr_t) (node)->s >= (uintptr_t) gbl_map && \
+	 (uintptr_t) (node)->s < (uintptr_t) gbl_map + gbl_maplen)
+
+static void ll_make_node(node_t *node, const char *s, size_t len);
+static void page_decode(long at);
+
+/* Mark functions */
+int markset(long at, int c) {
+	int i = c - '!';
+	gbl_marks[i] = at;
+	return i;
+}
+
+long markget(int c) {
+	return gbl_marks[c - '!'];
+}
+
+void markclear(int c) {
+	gbl_marks[c - '!'] = 0;
+}
+
+/* `n` lines were added (n > 0) or removed (n < 0) after line `at` */
+static void markshift(long at, long n) {
+	for (int i = 0; i < MARKLIM; ++i) {
+		if (gbl_marks[i] <= at)
+			continue;
+		if (n < 0 && gbl_marks[i] <= at - n)
+			gbl_marks[i] = 0;
+		else
+			gbl_marks[i] += n;
+	}
+}
+
+/* xorshift32, treap priorities only need to be spread out */
+static uint32_t ll_rand() {
+	static _Thread_local uint32_t x = 2463534242u;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static long weight(chunk_t *c) {
+	return (c) ? c->weight : 0;
+}
+
+static long gmarks(chunk_t *c) {
+	return (c) ? c->gmarks : 0;
+}
+
+static void update(chunk_t *c) {
+	c->weight = weight(c->left) + c->n + weight(c->right);
+	c->gmarks = gmarks(c->left) + c->ngmark + gmarks(c->right);
+	if (c->left)
+		c->left->parent = c;
+	if (c->right)
+		c->right->parent = c;
+}
+
+/* recompute the weights on the path from `c` to the root */
+static void fixup(chunk_t *c) {
+	for (; c != NULL; c = c->parent) {
+		c->weight = weight(c->left) + c->n + weight(c->right);
+		c->gmarks = gmarks(c->left) + c->ngmark + gmarks(c->right);
+	}
+}
+
+/* The marks g leaves on lines are bits in their chunks, which move with
+ * the lines. These only run for chunks that have marks in them.
+ */
+#define gbit(c, pos) (((c)->gmark[(pos) / 64] >> ((pos) % 64)) & 1)
+#define lowbits(o) (((uint64_t) 1 << (o)) - 1)
+
+/* a line was added at `pos`, move the bits from there up */
+static void gbits_insert(chunk_t *c, int pos) {
+	int w = pos / 64;
+	for (int i = CHUNKLIM / 64 - 1; i > w; --i)
+		c->gmark[i] = (c->gmark[i] << 1) | (c->gmark[i-1] >> 63);
+	uint64_t low = c->gmark[w] & lowbits(pos % 64);
+	c->gmark[w] = low | ((c->gmark[w] & ~lowbits(pos % 64)) << 1);
+}
+
+/* the line at `pos` was removed, move the bits past it down */
+static void gbits_remove(chunk_t *c, int pos) {
+	int w = pos / 64, o = pos % 64;
+	c->ngmark -= gbit(c, pos);
+	uint64_t low = c->gmark[w] & lowbits(o);
+	c->gmark[w] = low | ((c->gmark[w] >> o >> 1) << o);
+	for (; w < CHUNKLIM / 64 - 1; ++w) {
+		c->gmark[w] |= c->gmark[w+1] << 63;
+		c->gmark[w+1] >>= 1;
+	}
+}
+
+/* the `n` lines at `soff` in `src` moved to `doff` in `dst` */
+static void gbits_move(chunk_t *dst, int doff, chunk_t *src, int soff, int n) {
+	for (int i = 0; i < n; ++i) {
+		if (!gbit(src, soff + i))
+			continue;
+		src->gmark[(soff + i) / 64] &= ~((uint64_t) 1 << ((soff + i) % 64));
+		dst->gmark[(doff + i) / 64] |= (uint64_t) 1 << ((doff + i) % 64);
+		src->ngmark--;
+		dst->ngmark++;
+	}
+}
+
+static chunk_t *slab_get(slabs_t *sl, size_t size) {
+	chunk_t *c;
+	STATS_COUNT(STAT_ALLOC, 1, size);
+	if ((c = sl->free) != NULL) {
+		sl->free = c->left;
+		return c;
+	}
+	if (sl->slabs == NULL || sl->used == SLABLIM) {
+		slab_t *slab;
+		if (!(slab = malloc(sizeof(slab_t) + SLABLIM * size))) {
+			if (arena->oom != NULL)
+				longjmp(*arena->oom, 1);
+			io_err("malloc: %s\n", strerror(errno));
+		}
+		slab->next = sl->slabs;
+		sl->slabs = slab;
+		sl->used = 0;
+	}
+	return (chunk_t *) (sl->slabs->mem + size * sl->used++);
+}
+
+/* take over the slabs of `from`, whose chunks are all handed out */
+static void slab_adopt(slabs_t *sl, slabs_t *from) {
+	if (from->slabs == NULL)
+		return;
+	if (sl->slabs == NULL) {
+		sl->slabs = from->slabs;
+		sl->used = from->used;
+	}
+	else {
+		/* behind the newest, which chunks are still taken from */
+		slab_t *last = from->slabs;
+		while (last->next != NULL)
+			last = last->next;
+		last->next = sl->slabs->next;
+		sl->slabs->next = from->slabs;
+	}
+	from->slabs = NULL;
+	from->used = 0;
+}
+
+static void slab_free(slabs_t *sl) {
+	while (sl->slabs != NULL) {
+		slab_t *slab = sl->slabs;
+		sl->slabs = slab->next;
+		free(slab);
+	}
+	sl->used = 0;
+	sl->free = NULL;
+}
+
+static void chunk_init(chunk_t *c) {
+	c->left = c->right = c->parent = NULL;
+	c->weight = 0;
+	c->n = 0;
+	c->ngmark = 0;
+	c->gmarks = 0;
+	memset(c->gmark, 0, sizeof(c->gmark));
+	c->page = NULL;
+	c->pagesz = 0;
+	c->prio = ll_rand();
+}
+
+static chunk_t *chunk_new() {
+	chunk_t *c = slab_get(&arena->chunks, CHUNKSZ);
+	chunk_init(c);
+	return c;
+}
+
+/* a page of `n` lines in the `size` bytes at `s`, not counted in gbl_pages yet */
+static chunk_t *page_new(const char *s, size_t size, int n) {
+	chunk_t *c = slab_get(&arena->pages, sizeof(chunk_t));
+	chunk_init(c);
+	c->page = s;
+	c->pagesz = size;
+	c->n = c->weight = n;
+	return c;
+}
+
+static void chunk_release(chunk_t *c) {
+	slabs_t *sl = &gbl_arena.chunks;
+	if (c->page != NULL) {
+		sl = &gbl_arena.pages;
+		gbl_pages--;
+	}
+	c->left = sl->free;
+	sl->free = c;
+}
+
+/* release `c` and its subtree */
+static void chunk_free(chunk_t *c) {
+	if (c == NULL)
+		return;
+	chunk_free(c->left);
+	chunk_free(c->right);
+	chunk_release(c);
+}
+
+static chunk_t *chunk_first(chunk_t *c) {
+	while (c && c->left)
+		c = c->left;
+	return c;
+}
+
+static chunk_t *chunk_last(chunk_t *c) {
+	while (c && c->right)
+		c = c->right;
+	return c;
+}
+
+static chunk_t *chunk_next(chunk_t *c) {
+	if (c->right)
+		return chunk_first(c->right);
+	while (c->parent && c->parent->right == c)
+		c = c->parent;
+	return c->parent;
+}
+
+static void setroot(chunk_t *c) {
+	gbl_root = c;
+	if (c)
+		c->parent = NULL;
+}
+
+static chunk_t *merge(chunk_t *a, chunk_t *b) {
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (a->prio >= b->prio) {
+		a->right = merge(a->right, b);
+		update(a);
+		return a;
+	}
+	b->left = merge(a, b->left);
+	update(b);
+	return b;
+}
+
+/* The bytes from `from` to `to` of the mapping were read through. Their
+ * memory is only the file's, which the mapping reads in again when it is
+ * needed, so they needn't stay resident and make other pages go first.
+ */
+static void map_drop(const char *from, const char *to) {
+	uintptr_t psz = sysconf(_SC_PAGESIZE);
+	uintptr_t f = ((uintptr_t) from + psz - 1) & ~(psz - 1);
+	uintptr_t t = (uintptr_t) to & ~(psz - 1);
+	if (f < t)
+		madvise((void *) f, t - f, MADV_DONTNEED);
+}
+
+/* The start of every PAGESTEP'th line of the pages read last, so finding
+ * a line in a page doesn't mean walking it from the top. Every thread has
+ * a cache of its own, like the one of regular expressions. A cached page
+ * is left in memory, so there is a slot for every page the page limit
+ * holds, rounded down to a power of two; a page goes in the least
+ * recently used of the PAGEWAYS slots from where its address hashes to.
+ * A limit of fewer pages than that still has PAGEWAYS slots, but their
+ * pages are let go once their offsets are taken.
+ */
+#define PAGEWAYS 8
+#define PAGESTEP 64
+
+static size_t gbl_pageslots = ((size_t) 1 << 30) / PAGESZ;
+static bool gbl_pagekeep = true;
+
+static _Thread_local struct {
+	const char *page;	/* NULL if the slot is free */
+	size_t size;
+	unsigned long mapgen;
+	uint32_t *offs;		/* of lines 0, PAGESTEP, 2 * PAGESTEP... */
+	unsigned long used;
+}*pcache;
+static _Thread_local size_t npcache;
+
+static _Thread_local unsigned long ptick;
+
+/* free the calling thread's cache */
+static void pcache_free() {
+	for (size_t i = 0; i < npcache; ++i)
+		free(pcache[i].offs);
+	free(pcache);
+	pcache = NULL;
+	npcache = 0;
+}
+
+/* the offsets of page `c` from the cache, NULL if they can't be had */
+static const uint32_t *page_offsets(const chunk_t *c) {
+	if (npcache != gbl_pageslots) {
+		pcache_free();
+		if ((pcache = calloc(gbl_pageslots, sizeof(*pcache))) == NULL)
+			return NULL;
+		npcache = gbl_pageslots;
+	}
+	size_t h = (size_t) (((uint64_t) (uintptr_t) c->page * 0x9e3779b97f4a7c15ULL) >> 32);
+	size_t v = h & (npcache - 1);
+	for (size_t k = 0; k < PAGEWAYS; ++k) {
+		size_t i = (h + k) & (npcache - 1);
+		if (pcache[i].page == c->page && pcache[i].size == c->pagesz &&
+				pcache[i].mapgen == gbl_mapgen) {
+			pcache[i].used = ++ptick;
+			return pcache[i].offs;
+		}
+		if (pcache[i].used < pcache[v].used)
+			v = i;
+	}
+	if (c->pagesz > UINT32_MAX)
+		return NULL;
+	/* the page going out of the cache was read, it needn't stay in */
+	if (pcache[v].page != NULL && pcache[v].mapgen == gbl_mapgen)
+		map_drop(pcache[v].page, pcache[v].page + pcache[v].size);
+	uint32_t *offs = realloc(pcache[v].offs,
+			((c->n + PAGESTEP - 1) / PAGESTEP) * sizeof(uint32_t));
+	if (offs == NULL)
+		return NULL;
+
+	const char *nl[CHUNKLIM];
+	const char *p = c->page;
+	const char *end = c->page + c->pagesz;
+	offs[0] = 0;
+	for (long line = 1; line < c->n; ) {
+		size_t n = scan_newlines(p, end, nl, CHUNKLIM);
+		for (size_t i = 0; i < n && line < c->n; ++i, ++line) {
+			if (line % PAGESTEP == 0)
+				offs[line / PAGESTEP] = nl[i] + 1 - c->page;
+		}
+		p = nl[n-1] + 1;
+	}
+	if (!gbl_pagekeep)
+		map_drop(c->page, end);
+	pcache[v].page = c->page;
+	pcache[v].size = c->pagesz;
+	pcache[v].mapgen = gbl_mapgen;
+	pcache[v].offs = offs;
+	pcache[v].used = ++ptick;
+	return offs;
+}
+
+/* where line `pos` of page `c` starts */
+static size_t page_offset(const chunk_t *c, int pos) {
+	if (pos == 0)
+		return 0;
+	if (pos >= c->n)
+		return c->pagesz;
+	const uint32_t *offs = page_offsets(c);
+	size_t off = 0;
+	int line = 0;
+	if (offs != NULL) {
+		line = pos / PAGESTEP * PAGESTEP;
+		off = offs[pos / PAGESTEP];
+	}
+	for (; line < pos; ++line)
+		off = (const char *) memchr(c->page + off, '\n', c->pagesz - off) - c->page + 1;
+	return off;
+}
+
+/* the line of page `c` starting at `s`, in `node` */
+static node_t *page_node(const chunk_t *c, const char *s, node_t *node) {
+	const char *end = c->page + c->pagesz;
+	const char *nl = memchr(s, '\n', end - s);
+	node->s = (char *) s;
+	node->len = ((nl) ? nl : end) - s;
+	return node;
+}
+
+static void page_done(const chunk_t *c) {
+	map_drop(c->page, c->page + c->pagesz);
+}
+
+/* line `pos` of page `c`, in `node` */
+static node_t *page_line(const chunk_t *c, int pos, node_t *node) {
+	return page_node(c, c->page + page_offset(c, pos), node);
+}
+
+/* Put the first `k` lines of `t` in `l` and the rest in `r`.
+ * A chunk straddling the cut is split in two.
+ */
+static void split(chunk_t *t, long k, chunk_t **l, chunk_t **r) {
+	if (t == NULL) {
+		*l = *r = NULL;
+		return;
+	}
+	long lw = weight(t->left);
+	if (k <= lw) {
+		split(t->left, k, l, &t->left);
+		update(t);
+		*r = t;
+	}
+	else if (k >= lw + t->n) {
+		split(t->right, k - lw - t->n, &t->right, r);
+		update(t);
+		*l = t;
+	}
+	else if (t->page != NULL) {
+		/* a page splits into two at the line's offset */
+		int off = k - lw;
+		size_t at = page_offset(t, off);
+		chunk_t *t2 = page_new(t->page + at, t->pagesz - at, t->n - off);
+		gbl_pages++;
+		t2->prio = t->prio;
+		t->pagesz = at;
+		t->n = off;
+		t2->right = t->right;
+		t->right = NULL;
+		update(t);
+		update(t2);
+		*l = t;
+		*r = t2;
+	}
+	else {
+		int off = k - lw;
+		chunk_t *t2 = chunk_new();
+		/* same priority keeps the heap order for t's right subtree */
+		t2->prio = t->prio;
+		t2->n = t->n - off;
+		memcpy(t2->lines, t->lines + off, t2->n * sizeof(node_t));
+		if (t->ngmark > 0)
+			gbits_move(t2, 0, t, off, t2->n);
+		t->n = off;
+		t2->right = t->right;
+		t->right = NULL;
+		update(t);
+		update(t2);
+		*l = t;
+		*r = t2;
+	}
+}
+
+static void cut(long k, chunk_t **l, chunk_t **r) {
+	split(gbl_root, k, l, r);
+	if (*l)
+		(*l)->parent = NULL;
+	if (*r)
+		(*r)->parent = NULL;
+}
+
+/* take `c` out of the tree and free it, its lines must be gone already */
+static void chunk_unlink(chunk_t *c) {
+	chunk_t *p = c->parent;
+	chunk_t *m = merge(c->left, c->right);
+	if (m)
+		m->parent = p;
+	if (p == NULL)
+		gbl_root = m;
+	else if (p->left == c)
+		p->left = m;
+	else
+		p->right = m;
+	fixup(p);
+	chunk_release(c);
+}
+
+/* Make the list `a` followed by `b`. Chunks on either side of the seam
+ * are coalesced when they fit in one, so cutting the list up does not
+ * leave it fragmented.
+ */
+static void relink(chunk_t *a, chunk_t *b) {
+	chunk_t *lc = chunk_last(a);
+	chunk_t *rc = chunk_first(b);
+	setroot(merge(a, b));
+	if (lc && rc && !lc->page && !rc->page && lc->n + rc->n <= CHUNKLIM) {
+		memcpy(lc->lines + lc->n, rc->lines, rc->n * sizeof(node_t));
+		if (rc->ngmark > 0)
+			gbits_move(lc, lc->n, rc, 0, rc->n);
+		lc->n += rc->n;
+		fixup(lc);
+		rc->n = 0;
+		chunk_unlink(rc);
+	}
+}
+
+/* find the chunk holding line `at` and its position in there */
+static chunk_t *find(long at, int *pos) {
+	chunk_t *c = gbl_root;
+	at--;
+	while (c != NULL) {
+		long lw = weight(c->left);
+		if (at < lw) {
+			c = c->left;
+		}
+		else if (at < lw + c->n) {
+			*pos = at - lw;
+			return c;
+		}
+		else {
+			at -= lw + c->n;
+			c = c->right;
+		}
+	}
+	return NULL;
+}
+
+/* The undo journal. Changes are recorded as they are made, as what it
+ * takes to reverse them: lines to remove again, the nodes of removed
+ * lines to put back, the old nodes of lines whose text was set. Text is
+ * never freed before ll_free(), so old nodes can simply point at it and
+ * a step costs memory in proportion to the lines it touched, not to the
+ * size of the buffer. A step is everything done between two ll_step()s.
+ */
+
+static size_t jrec_bytes(jrec_t *r) {
+	return r->cap * (sizeof(node_t) + ((r->lines) ? sizeof(long) : 0));
+}
+
+static void jstep_free(jstep_t *step) {
+	for (long i = 0; i < step->n; ++i) {
+		gbl_journal.bytes -= jrec_bytes(&step->recs[i]);
+		free(step->recs[i].lines);
+		free(step->recs[i].nodes);
+	}
+	free(step->recs);
+	step->recs = NULL;
+	step->n = step->cap = 0;
+}
+
+static void jstack_clear(jstep_t *steps, long *n) {
+	while (*n > 0)
+		jstep_free(&steps[--*n]);
+}
+
+static void *jgrow(void *p, long *cap, size_t size) {
+	long ncap = *cap * 2 + 16;
+	if ((p = realloc(p, ncap * size)) == NULL)
+		io_err("realloc: %s\n", strerror(errno));
+	*cap = ncap;
+	return p;
+}
+
+static void jpush(jstep_t **steps, long *n, long *cap, jstep_t step) {
+	if (*n == *cap)
+		*steps = jgrow(*steps, cap, sizeof(jstep_t));
+	(*steps)[(*n)++] = step;
+}
+
+/* Drop the oldest steps until the journal fits its limit. If the open
+ * step doesn't fit on its own it goes too and nothing more is recorded
+ * until the next one.
+ */
+static void jtrim() {
+	jstep_t *u = gbl_journal.undo;
+	long drop = 0;
+	while (gbl_journal.bytes > gbl_journal.limit && drop < gbl_journal.nundo - 1)
+		jstep_free(&u[drop++]);
+	if (drop > 0) {
+		memmove(u, u + drop, (gbl_journal.nundo - drop) * sizeof(jstep_t));
+		gbl_journal.nundo -= drop;
+	}
+	if (gbl_journal.bytes > gbl_journal.limit) {
+		jstack_clear(gbl_journal.undo, &gbl_journal.nundo);
+		gbl_journal.off = true;
+	}
+}
+
+/* the record a change of kind `op` at line `at` goes into, NULL if the
+ * change isn't recorded
+ */
+static jrec_t *jrec(char op, long at) {
+	if (gbl_journal.replaying || gbl_journal.limit == 0)
+		return NULL;
+	if (!gbl_journal.open) {
+		gbl_journal.open = true;
+		gbl_journal.off = false;
+		jstack_clear(gbl_journal.redo, &gbl_journal.nredo);
+		jpush(&gbl_journal.undo, &gbl_journal.nundo, &gbl_journal.capundo,
+				(jstep_t) { .line = gbl_current_line });
+	}
+	if (gbl_journal.off)
+		return NULL;
+
+	jstep_t *step = &gbl_journal.undo[gbl_journal.nundo - 1];
+	jrec_t *last = (step->n > 0) ? &step->recs[step->n - 1] : NULL;
+	/* runs of the same change go into one record: lines added one
+	 * after the other, removed at the same spot, set further down
+	 */
+	if (last != NULL && last->op == op &&
+			((op == 'd' && last->at + last->n == at) ||
+			 (op == 'a' && last->at == at) ||
+			 (op == 's' && last->lines[last->n - 1] < at)))
+		return last;
+	if (step->n == step->cap)
+		step->recs = jgrow(step->recs, &step->cap, sizeof(jrec_t));
+	step->recs[step->n] = (jrec_t) { .op = op, .at = at };
+	return &step->recs[step->n++];
+}
+
+/* Room for `n` more nodes in `r`, 1 if it had to grow; the caller
+ * calls jtrim() once it is done with `r`, which might free it. A record
+ * that would be over the limit by itself is never allocated: the step
+ * goes as jtrim() would let it go and `r` with it, -1 is returned.
+ */
+static int jreserve(jrec_t *r, long n) {
+	if (r->cap - r->n >= n)
+		return 0;
+	size_t each = sizeof(node_t) + ((r->op == 's') ? sizeof(long) : 0);
+	if ((size_t) (r->n + n) > gbl_journal.limit / each) {
+		jstack_clear(gbl_journal.undo, &gbl_journal.nundo);
+		gbl_journal.off = true;
+		return -1;
+	}
+	size_t before = jrec_bytes(r);
+	long cap = r->cap;
+	while (cap - r->n < n)
+		cap = cap * 2 + 16;
+	/* doubling needn't take it over the limit either */
+	if ((size_t) cap > gbl_journal.limit / each)
+		cap = gbl_journal.limit / each;
+	node_t *nodes = realloc(r->nodes, cap * sizeof(node_t));
+	if (nodes == NULL)
+		io_err("realloc: %s\n", strerror(errno));
+	r->nodes = nodes;
+	if (r->op == 's') {
+		long *lines = realloc(r->lines, cap * sizeof(long));
+		if (lines == NULL)
+			io_err("realloc: %s\n", strerror(errno));
+		r->lines = lines;
+	}
+	r->cap = cap;
+	gbl_journal.bytes += jrec_bytes(r) - before;
+	return 1;
+}
+
+/* lines `at` to `at + n - 1` were added */
+static void jadded(long at, long n) {
+	jrec_t *r = jrec('d', at);
+	if (r != NULL)
+		r->n += n;
+}
+
+/* lines `from` to `to` are about to be removed */
+static void jremoving(long from, long to) {
+	jrec_t *r = jrec('a', from);
+	if (r == NULL)
+		return;
+	int grew = jreserve(r, to - from + 1);
+	if (grew == -1)
+		return;
+	ll_iter_t it;
+	node_t *node = ll_iter_at(&it, from);
+	for (; from <= to; ++from, node = ll_iter_next(&it))
+		r->nodes[r->n++] = *node;
+	if (grew)
+		jtrim();
+}
+
+/* the text of line `at`, `node`, is about to be set */
+static void jsetting(long at, node_t *node) {
+	jrec_t *r = jrec('s', at);
+	if (r == NULL)
+		return;
+	int grew = jreserve(r, 1);
+	if (grew == -1)
+		return;
+	r->lines[r->n] = at;
+	r->nodes[r->n++] = *node;
+	if (grew)
+		jtrim();
+}
+
+/* lines `at` to `at + n - 1` were moved here from after line `to` */
+static void jmoved(long at, long n, long to) {
+	jrec_t *r = jrec('m', at);
+	if (r != NULL) {
+		r->n = n;
+		r->to = to;
+	}
+}
+
+char *ll_alloc(size_t len) {
+	block_t *b = gbl_arena.blocks;
+	STATS_COUNT(STAT_ALLOC, 1, len);
+	if (b == NULL || b->size - b->used < len) {
+		size_t size = (len > BLOCKSZ) ? len : BLOCKSZ;
+		block_t *nb;
+		if (!(nb = malloc(sizeof(block_t) + size))) {
+			io_err("malloc: %s\n", strerror(errno));
+		}
+		nb->data = (char *) (nb + 1);
+		nb->size = size;
+		nb->used = 0;
+		/* a line too long for a block gets one of its own, which
+		 * goes behind the one being bumped through */
+		if (b != NULL && size > BLOCKSZ) {
+			nb->next = b->next;
+			b->next = nb;
+		}
+		else {
+			nb->next = b;
+			gbl_arena.blocks = nb;
+		}
+		b = nb;
+	}
+	char *s = b->data + b->used;
+	b->used += len;
+	return s;
+}
+
+void ll_adopt(char *buf, size_t len) {
+	block_t *b;
+	STATS_COUNT(STAT_ALLOC, 1, len);
+	if (!(b = malloc(sizeof(block_t)))) {
+		free(buf);
+		io_err("malloc: %s\n", strerror(errno));
+	}
+	b->data = buf;
+	b->size = b->used = len;
+	/* behind the block being bumped through, like a long line */
+	if (gbl_arena.blocks != NULL) {
+		b->next = gbl_arena.blocks->next;
+		gbl_arena.blocks->next = b;
+	}
+	else {
+		b->next = NULL;
+		gbl_arena.blocks = b;
+	}
+}
+
+static void ll_make_node(node_t *node, const char *s, size_t len) {
+	node->s = ll_alloc(len);
+	memcpy(node->s, s, len);
+	node->len = len;
+}
+
+void ll_print() {
+	ll_iter_t it;
+	for (node_t *n = ll_iter_at(&it, 1); n != NULL; n = ll_iter_next(&it)) {
+		fwrite(n->s, 1, n->len, stdout);
+		putchar('\n');
+	}
+}
+
+long ll_add_node(long at, const char *s, size_t len) {
+	state.saved = false;
+
+	chunk_t *c;
+	int pos = 0;
+	if (gbl_root == NULL) {
+		setroot(c = chunk_new());
+	}
+	else if (at == 0) {
+		c = find(1, &pos);
+	}
+	else {
+		c = find(at, &pos);
+		pos++;
+	}
+
+	if (c->page != NULL) {
+		/* pages aren't added to, the line goes in a chunk between */
+		chunk_t *l, *r;
+		cut(at, &l, &r);
+		c = chunk_new();
+		setroot(merge(merge(l, c), r));
+		pos = 0;
+	}
+	else if (c->n == CHUNKLIM) {
+		chunk_t *l, *r;
+		long base = at - pos;
+		chunk_t *next = (pos == CHUNKLIM) ? chunk_next(c) : NULL;
+		if (next && !next->page && next->n < CHUNKLIM) {
+			c = next;
+			pos = 0;
+		}
+		else if (pos == CHUNKLIM) {
+			/* adding past the end of a full chunk: start a new one */
+			cut(base + CHUNKLIM, &l, &r);
+			c = chunk_new();
+			setroot(merge(merge(l, c), r));
+			pos = 0;
+		}
+		else {
+			cut(base + CHUNKLIM / 2, &l, &r);
+			setroot(merge(l, r));
+			return ll_add_node(at, s, len);
+		}
+	}
+
+	jadded(at + 1, 1);
+	if (c->ngmark > 0)
+		gbits_insert(c, pos);
+	memmove(c->lines + pos + 1, c->lines + pos, (c->n - pos) * sizeof(node_t));
+	ll_make_node(&c->lines[pos], s, len);
+	c->n++;
+	fixup(c);
+	gbl_len++;
+	markshift(at, 1);
+	gbl_current_line = at + 1;
+	return gbl_current_line;
+}
+
+long ll_add_begin(const char *s, size_t len) {
+	return ll_add_node(0, s, len);
+}
+
+long ll_add_end(const char *s, size_t len) {
+	return ll_add_node(gbl_len, s, len);
+}
+
+/* take the lines from `from` to `to` out of the list */
+static void cut_out(long from, long to) {
+	chunk_t *l, *m, *r;
+	cut(to, &l, &r);
+	split(l, from - 1, &l, &m);
+	if (l)
+		l->parent = NULL;
+	chunk_free(m);
+	relink(l, r);
+}
+
+long ll_remove_node(long at) {
+	state.saved = false;
+
+	int pos;
+	chunk_t *c = find(at, &pos);
+	if (c == NULL) {
+		io_err("ll_remove_node: No line %ld; can't remove\n", at);
+	}
+	jremoving(at, at);
+	if (c->page != NULL) {
+		cut_out(at, at);
+	}
+	else {
+		if (c->ngmark > 0)
+			gbits_remove(c, pos);
+		c->n--;
+		memmove(c->lines + pos, c->lines + pos + 1, (c->n - pos) * sizeof(node_t));
+		if (c->n == 0)
+			chunk_unlink(c);
+		else
+			fixup(c);
+	}
+
+	gbl_len--;
+	markshift(at - 1, -1);
+	gbl_current_line = (at <= gbl_len) ? at : gbl_len;
+	return gbl_current_line;
+}
+
+long ll_remove_range(long from, long to) {
+	state.saved = false;
+	if (from < 1 || to > gbl_len || from > to) {
+		io_err("ll_remove_range: Bad range %ld,%ld; can't remove\n", from, to);
+	}
+	/* cheaper than cutting the list up */
+	if (from == to)
+		return ll_remove_node(from);
+	jremoving(from, to);
+	cut_out(from, to);
+
+	gbl_len -= to - from + 1;
+	markshift(from - 1, -(to - from + 1));
+	gbl_current_line = (from <= gbl_len) ? from : gbl_len;
+	return gbl_current_line;
+}
+
+long ll_remove_begin() {
+	if (gbl_len == 0) {
+		io_err("ll_remove_begin: Head empty; can't remove\n");
+	}
+	return ll_remove_node(1);
+}
+
+long ll_remove_end() {
+	if (gbl_len == 0) {
+		io_err("ll_remove_end: Tail empty; can't remove\n");
+	}
+	return ll_remove_node(gbl_len);
+}
+
+void ll_node_set(long at, node_t *node, char *s, size_t len) {
+	state.saved = false;
+	int pos;
+	if (gbl_pages > 0 && find(at, &pos)->page != NULL) {
+		/* the line only gets a node of its own with the rest of its page */
+		page_decode(at);
+		node = ll_at(at);
+	}
+	jsetting(at, node);
+	node->s = s;
+	node->len = len;
+}
+
+void ll_replace(long at, char *s, size_t len) {
+	node_t *node = ll_at(at);
+	if (node == NULL) {
+		io_err("ll_replace: No line %ld\n", at);
+	}
+	ll_node_set(at, node, s, len);
+}
+
+node_t *ll_at(long at) {
+	int pos;
+	if (at < 1 || at > gbl_len)
+		return NULL;
+	chunk_t *c = find(at, &pos);
+	if (c->page != NULL) {
+		static _Thread_local node_t node;
+		return page_line(c, pos, &node);
+	}
+	return &c->lines[pos];
+}
+
+node_t *ll_iter_at(ll_iter_t *it, long at) {
+	if (at < 1 || at > gbl_len)
+		return NULL;
+	it->chunk = find(at, &it->pos);
+	it->at = at;
+	it->gen = gbl_gen;
+	if (it->chunk->page != NULL)
+		return page_line(it->chunk, it->pos, &it->node);
+	return &it->chunk->lines[it->pos];
+}
+
+node_t *ll_iter_next(ll_iter_t *it) {
+	/* pages were turned into nodes, the chunk might be gone */
+	if (it->gen != gbl_gen)
+		return ll_iter_at(it, it->at + 1);
+	it->at++;
+	if (++it->pos >= it->chunk->n) {
+		if (it->chunk->page != NULL)
+			page_done(it->chunk);
+		if ((it->chunk = chunk_next(it->chunk)) == NULL)
+			return NULL;
+		it->pos = 0;
+		if (it->chunk->page != NULL)
+			return page_node(it->chunk, it->chunk->page, &it->node);
+	}
+	else if (it->chunk->page != NULL) {
+		return page_node(it->chunk, it->node.s + it->node.len + 1, &it->node);
+	}
+	return &it->chunk->lines[it->pos];
+}
+
+/* put the `lines` lines in the chunks of `list` after line `at` */
+static void splice_list(long at, chunk_t *list, long lines) {
+	chunk_t *l, *r;
+	cut(at, &l, &r);
+	list->parent = NULL;
+	relink(l, list);
+	relink(gbl_root, r);
+
+	state.saved = false;
+	gbl_len += lines;
+	markshift(at, lines);
+	gbl_current_line = at + lines;
+}
+
+/* put the `n` lines at `nodes` after line `at` as they are */
+static void insert_nodes(long at, const node_t *nodes, long n) {
+	chunk_t *list = NULL;
+	for (long i = 0; i < n; i += CHUNKLIM) {
+		chunk_t *c = chunk_new();
+		c->n = (n - i < CHUNKLIM) ? n - i : CHUNKLIM;
+		memcpy(c->lines, nodes + i, c->n * sizeof(node_t));
+		update(c);
+		list = merge(list, c);
+	}
+	if (n > 0)
+		splice_list(at, list, n);
+}
+
+/* put a line at the end of `c`, as a copy or as a view of `s` */
+static void chunk_add(chunk_t *c, const char *s, size_t len, bool copy) {
+	if (copy)
+		ll_make_node(&c->lines[c->n], s, len);
+	else
+		c->lines[c->n] = (node_t) { (char *) s, len };
+	c->n++;
+}
+
+/* the lines in `buf` in a list of chunks of their own, their number
+ * goes in `lines`
+ */
+static chunk_t *chunk_list(const char *buf, size_t size, bool copy, long *lines) {
+	const char *nl[CHUNKLIM];
+	const char *p = buf;
+	const char *end = buf + size;
+	chunk_t *list = NULL;
+	*lines = 0;
+
+	/* a chunk's worth of newlines at a time into a list of their own */
+	while (p < end) {
+		chunk_t *c = chunk_new();
+		size_t n = scan_newlines(p, end, nl, CHUNKLIM);
+		for (size_t i = 0; i < n; ++i) {
+			chunk_add(c, p, nl[i] - p, copy);
+			p = nl[i] + 1;
+		}
+		/* the last line has no newline */
+		if (n < CHUNKLIM && p < end) {
+			chunk_add(c, p, end - p, copy);
+			p = end;
+		}
+		update(c);
+		list = merge(list, c);
+		*lines += c->n;
+	}
+	return list;
+}
+
+long ll_add_lines(long at, const char *buf, size_t size, bool copy) {
+	long lines;
+	chunk_t *list = chunk_list(buf, size, copy, &lines);
+	if (lines == 0)
+		return 0;
+	jadded(at + 1, lines);
+	splice_list(at, list, lines);
+	return lines;
+}
+
+/* Turn the page holding line `at` into chunks of nodes viewing it */
+static void page_decode(long at) {
+	int pos;
+	chunk_t *c = find(at, &pos);
+	if (c == NULL || c->page == NULL)
+		return;
+	chunk_t *l, *m, *r;
+	long lines;
+	cut(at - pos - 1, &l, &r);
+	split(r, c->n, &m, &r);
+	chunk_t *list = chunk_list(c->page, c->pagesz, false, &lines);
+	chunk_free(m);
+	relink(l, list);
+	relink(gbl_root, r);
+	gbl_gen++;
+}
+
+/* past the first newline at or after `p` + `size`, or `end` */
+static const char *line_after(const char *p, const char *end, size_t size) {
+	if ((size_t) (end - p) <= size)
+		return end;
+	const char *q = memchr(p + size - 1, '\n', end - (p + size) + 1);
+	return (q != NULL) ? q + 1 : end;
+}
+
+/* The `size` bytes at `map` in a list of pages of their own. Only their
+ * newlines are counted, no line gets a node. The lines go in `lines`
+ * and the pages in `pages`.
+ */
+static chunk_t *page_list(const char *map, size_t size, long *lines, long *pages) {
+	const char *nl[CHUNKLIM];
+	const char *p = map;
+	const char *end = map + size;
+	chunk_t *list = NULL;
+	*lines = *pages = 0;
+
+	while (p < end) {
+		/* a page ends with a line */
+		const char *e = line_after(p, end, PAGESZ);
+		long n = 0;
+		for (const char *s = p; s < e; ) {
+			size_t k = scan_newlines(s, e, nl, CHUNKLIM);
+			n += k;
+			if (k < CHUNKLIM) {
+				/* the last line has no newline */
+				if (e == end && end[-1] != '\n')
+					n++;
+				break;
+			}
+			s = nl[k-1] + 1;
+		}
+		chunk_t *c = page_new(p, e - p, n);
+		page_done(c);
+		list = merge(list, c);
+		*lines += n;
+		(*pages)++;
+		p = e;
+	}
+	return list;
+}
+
+/* the `size` bytes at `map` in pages after line `at` */
+static long page_lines(long at, const char *map, size_t size) {
+	long lines, pages;
+	chunk_t *list = page_list(map, size, &lines, &pages);
+	gbl_pages += pages;
+	if (lines > 0) {
+		jadded(at + 1, lines);
+		splice_list(at, list, lines);
+	}
+	return lines;
+}
+
+/* where line `line` ends up when lines `from` to `to` move after `at` */
+static long moved(long line, long from, long to, long at) {
+	long n = to - from + 1;
+	if (line >= from && line <= to)
+		return line - from + ((at < from) ? at + 1 : at - n + 1);
+	if (at < from && line > at && line < from)
+		return line + n;
+	if (at > to && line > to && line <= at)
+		return line - n;
+	return line;
+}
+
+/* the lines from `from` to `to` cut out and put back after `at` */
+static void move_lines(long from, long to, long at) {
+	chunk_t *l, *m, *r, *a, *b;
+	cut(to, &l, &r);
+	split(l, from - 1, &l, &m);
+	if (at < from) {
+		split(l, at, &a, &b);
+		relink(a, m);
+		relink(gbl_root, b);
+		relink(gbl_root, r);
+	}
+	else {
+		split(r, at - to, &a, &b);
+		relink(l, a);
+		relink(gbl_root, m);
+		relink(gbl_root, b);
+	}
+	for (int i = 0; i < MARKLIM; ++i)
+		gbl_marks[i] = moved(gbl_marks[i], from, to, at);
+	state.saved = false;
+}
+
+long ll_move(long from, long to, long at) {
+	if (from < 1 || to > gbl_len || from > to || at < 0 || at > gbl_len ||
+			(at >= from && at < to))
+		io_err("ll_move: Bad destination %ld for %ld,%ld\n", at, from, to);
+	long n = to - from + 1;
+	/* already there */
+	if (at == from - 1 || at == to) {
+		gbl_current_line = to;
+		return to;
+	}
+	move_lines(from, to, at);
+	if (at < from) {
+		jmoved(at + 1, n, from - 1 + n);
+		gbl_current_line = at + n;
+	}
+	else {
+		jmoved(at - n + 1, n, from - 1);
+		gbl_current_line = at;
+	}
+	return gbl_current_line;
+}
+
+long ll_copy(long from, long to, long at) {
+	if (from < 1 || to > gbl_len || from > to || at < 0 || at > gbl_len)
+		io_err("ll_copy: Bad range %ld,%ld\n", from, to);
+	long n = to - from + 1;
+	chunk_t *list = NULL;
+	ll_iter_t it;
+	node_t *node = ll_iter_at(&it, from);
+	for (long i = 0; i < n; i += CHUNKLIM) {
+		chunk_t *c = chunk_new();
+		while (c->n < CHUNKLIM && i + c->n < n) {
+			c->lines[c->n++] = *node;
+			node = ll_iter_next(&it);
+		}
+		update(c);
+		list = merge(list, c);
+	}
+	jadded(at + 1, n);
+	splice_list(at, list, n);
+	return gbl_current_line;
+}
+
+/* A file loaded in the background. The editor takes in the first block
+ * itself and the loader thread goes on with the rest a block at a time,
+ * each into a list of its own out of slabs of its own, which it leaves in
+ * `list` for ll_sync() to put at the end of the buffer. The buffer is the
+ * editor's alone, the loader only ever touches what it hasn't handed over.
+ */
+#define FIRSTBLK (1 << 18)	/* what is there before the first prompt */
+#define LOADBLK (1 << 22)	/* what the loader hands over at a time */
+
+static bool gbl_background;
+
+static void loader_read(loader_t *ld, const char *p, const char *end) {
+	while (p < end) {
+		const char *e = line_after(p, end, LOADBLK);
+		long lines, pages = 0;
+		chunk_t *list = (ld->paged) ? page_list(p, e - p, &lines, &pages) :
+			chunk_list(p, e - p, false, &lines);
+
+		pthread_mutex_lock(&ld->lock);
+		ld->list = merge(ld->list, list);
+		ld->lines += lines;
+		ld->pages += pages;
+		bool stop = ld->stop;
+		pthread_cond_signal(&ld->cond);
+		pthread_mutex_unlock(&ld->lock);
+		if (stop)
+			return;
+		p = e;
+	}
+}
+
+static void *loader_run(void *arg) {
+	loader_t *ld = arg;
+	jmp_buf oom;
+	bool failed = false;
+	arena = &ld->arena;
+	arena->oom = &oom;
+	if (setjmp(oom) == 0)
+		loader_read(ld, ld->from, ld->to);
+	else
+		failed = true;
+
+	pthread_mutex_lock(&ld->lock);
+	ld->done = true;
+	ld->failed = failed;
+	pthread_cond_signal(&ld->cond);
+	pthread_mutex_unlock(&ld->lock);
+	return NULL;
+}
+
+/* load the `size` bytes at `map` after the last line, in the background
+ * past the first block
+ */
+static long loader_start(const char *map, size_t size, bool paged) {
+	const char *end = map + size;
+	const char *e = line_after(map, end, FIRSTBLK);
+	long lines = (paged) ? page_lines(gbl_len, map, e - map) :
+		ll_add_lines(gbl_len, map, e - map, false);
+	if (e == end)
+		return lines;
+
+	gbl_loader.paged = paged;
+	gbl_loader.from = e;
+	gbl_loader.to = end;
+	gbl_loader.list = NULL;
+	gbl_loader.lines = gbl_loader.pages = 0;
+	gbl_loader.stop = gbl_loader.done = gbl_loader.failed = false;
+	if (pthread_create(&gbl_loader.thread, NULL, loader_run, &gbl_loader) != 0) {
+		/* the rest now then */
+		return lines + ((paged) ? page_lines(gbl_len, e, end - e) :
+				ll_add_lines(gbl_len, e, end - e, false));
+	}
+	gbl_loader.running = true;
+	return lines;
+}
+
+/* join the loader, which is done, and take over its slabs */
+static void loader_join() {
+	pthread_join(gbl_loader.thread, NULL);
+	gbl_loader.running = false;
+	slab_adopt(&gbl_arena.chunks, &gbl_loader.arena.chunks);
+	slab_adopt(&gbl_arena.pages, &gbl_loader.arena.pages);
+}
+
+/* stop the loader and drop what it hasn't handed over, for ll_free() */
+static void loader_stop() {
+	if (!gbl_loader.running)
+		return;
+	pthread_mutex_lock(&gbl_loader.lock);
+	gbl_loader.stop = true;
+	while (!gbl_loader.done)
+		pthread_cond_wait(&gbl_loader.cond, &gbl_loader.lock);
+	gbl_loader.list = NULL;
+	pthread_mutex_unlock(&gbl_loader.lock);
+	loader_join();
+}
+
+/* Put `list` at the end. The file is being loaded, not changed, so none
+ * of it is journaled or unsaved, and the current line stays where it is
+ * unless it is at the end, where it stays too.
+ */
+static void loader_take(chunk_t *list, long lines, long pages) {
+	long current = gbl_current_line;
+	bool atend = current == gbl_len;
+	bool saved = state.saved;
+	splice_list(gbl_len, list, lines);
+	gbl_pages += pages;
+	state.saved = saved;
+	if (!atend)
+		gbl_current_line = current;
+}
+
+void ll_sync(long line) {
+	if (!gbl_loader.running)
+		return;
+	pthread_mutex_lock(&gbl_loader.lock);
+	for (;;) {
+		if (gbl_loader.list != NULL) {
+			chunk_t *list = gbl_loader.list;
+			long lines = gbl_loader.lines;
+			long pages = gbl_loader.pages;
+			gbl_loader.list = NULL;
+			gbl_loader.lines = gbl_loader.pages = 0;
+			pthread_mutex_unlock(&gbl_loader.lock);
+			loader_take(list, lines, pages);
+			pthread_mutex_lock(&gbl_loader.lock);
+			continue;
+		}
+		if (gbl_len >= line || gbl_loader.done)
+			break;
+		pthread_cond_wait(&gbl_loader.cond, &gbl_loader.lock);
+	}
+	bool done = gbl_loader.done;
+	bool failed = gbl_loader.failed;
+	pthread_mutex_unlock(&gbl_loader.lock);
+	if (done) {
+		loader_join();
+		if (failed)
+			io_err("Out of memory, %ld lines of the file loaded\n", gbl_len);
+	}
+}
+
+bool ll_loading() {
+	return gbl_loader.running;
+}
+
+void ll_background(bool on) {
+	gbl_background = on;
+}
+
+long ll_map_file(int fd) {
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return -1;
+	if (st.st_size == 0)
+		return 0;
+
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	ll_unmap();
+	gbl_map = map;
+	gbl_maplen = st.st_size;
+	gbl_mapdev = st.st_dev;
+	gbl_mapino = st.st_ino;
+	gbl_mapfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	gbl_filesize = st.st_size;
+	gbl_filetime = st.st_mtim;
+	gbl_mapgen = atomic_fetch_add(&gbl_mapgens, 1) + 1;
+
+	bool paged = (size_t) st.st_size > gbl_pagelimit;
+	if (gbl_background)
+		return loader_start(map, st.st_size, paged);
+	if (paged)
+		return page_lines(gbl_len, map, st.st_size);
+	return ll_add_lines(gbl_len, map, st.st_size, false);
+}
+
+void ll_page_limit(size_t bytes) {
+	gbl_pagelimit = bytes;
+	size_t slots = PAGEWAYS;
+	while (slots <= bytes / PAGESZ / 2)
+		slots *= 2;
+	gbl_pageslots = slots;
+	gbl_pagekeep = bytes / PAGESZ >= PAGEWAYS;
+}
+
+void ll_unmap() {
+	if (gbl_map == NULL)
+		return;
+	ll_sync(LONG_MAX);
+	/* the journal could still point into it */
+	ll_journal_clear();
+	for (long at = 1; gbl_pages > 0 && at <= gbl_len; ) {
+		int pos;
+		chunk_t *c = find(at, &pos);
+		long next = at - pos + c->n;
+		page_decode(at);
+		at = next;
+	}
+	ll_iter_t it;
+	for (node_t *n = ll_iter_at(&it, 1); n != NULL; n = ll_iter_next(&it)) {
+		if (isview(n))
+			ll_make_node(n, n->s, n->len);
+	}
+	munmap(gbl_map, gbl_maplen);
+	gbl_map = NULL;
+	gbl_maplen = 0;
+	if (gbl_mapfd != -1)
+		close(gbl_mapfd);
+	gbl_mapfd = -1;
+}
+
+bool ll_ismapped(const char *filename) {
+	struct stat st;
+	if (gbl_map == NULL || stat(filename, &st) == -1)
+		return false;
+	return st.st_dev == gbl_mapdev && st.st_ino == gbl_mapino;
+}
+
+void ll_free() {
+	loader_stop();
+	ll_journal_clear();
+	slab_free(&gbl_arena.chunks);
+	slab_free(&gbl_arena.pages);
+	gbl_pages = 0;
+	pcache_free();
+	while (gbl_arena.blocks != NULL) {
+		block_t *b = gbl_arena.blocks;
+		gbl_arena.blocks = b->next;
+		if (b->data != (char *) (b + 1))
+			free(b->data);
+		free(b);
+	}
+	gbl_root = NULL;
+	if (gbl_map) {
+		munmap(gbl_map, gbl_maplen);
+		gbl_map = NULL;
+		gbl_maplen = 0;
+	}
+	if (gbl_mapfd != -1)
+		close(gbl_mapfd);
+	gbl_mapfd = -1;
+	gbl_len = 0;
+	gbl_current_line = 0;
+	memset(gbl_marks, 0, sizeof(gbl_marks));
+}
+
+buffer_t *ll_buffer_new() {
+	buffer_t *b = calloc(1, sizeof(buffer_t));
+	struct list *l = calloc(1, sizeof(struct list));
+	if (b == NULL || l == NULL) {
+		free(b);
+		free(l);
+		return NULL;
+	}
+	l->mapfd = -1;
+	l->journal.limit = gbl_journal.limit;
+	pthread_mutex_init(&l->loader.lock, NULL);
+	pthread_cond_init(&l->loader.cond, NULL);
+	b->list = l;
+	b->st.sync = state.sync;
+	b->st.patch = state.patch;
+	b->st.script = state.script;
+	return b;
+}
+
+void ll_buffer_use(buffer_t *b) {
+	gbl_buffer = b;
+	gbl_list = b->list;
+	arena = &gbl_list->arena;
+}
+
+void ll_buffer_free(buffer_t *b) {
+	buffer_t *current = gbl_buffer;
+	ll_buffer_use(b);
+	ll_free();
+	ll_buffer_use(current);
+	struct list *l = b->list;
+	free(l->journal.undo);
+	free(l->journal.redo);
+	pthread_mutex_destroy(&l->loader.lock);
+	pthread_cond_destroy(&l->loader.cond);
+	free(b->st.filename);
+	free(b->st.pattern);
+	free(b->st.replace);
+	free(l);
+	free(b);
+}
+
+/* writev() all of `iov`, picking up after short writes */
+static int writev_all(int fd, struct iovec *iov, int n) {
+	while (n > 0) {
+		ssize_t w = writev(fd, iov, n);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (; n > 0 && (size_t) w >= iov->iov_len; ++iov, --n)
+			w -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 0;
+}
+
+/* bytes of the mapped file worth a copy_file_range() of their own */
+#define COPYMIN (1 << 16)
+
+/* Copy the `len` bytes of the mapping at `s` to `fd` out of the file
+ * itself with copy_file_range(), which has the kernel copy them, or share
+ * their blocks, without them being read in here. Pipes, like the input
+ * of a shell command, take them with splice() instead. Returns how many
+ * of them are left over for a target it can't copy to, like an O_APPEND
+ * file.
+ */
+static size_t map_copy(int fd, const char *s, size_t len) {
+	loff_t off = s - gbl_map;
+	while (gbl_copying != COPY_NONE && gbl_mapfd != -1 && len > 0) {
+		ssize_t w = (gbl_copying == COPY_RANGE) ?
+			copy_file_range(gbl_mapfd, &off, fd, NULL, len, 0) :
+			splice(gbl_mapfd, &off, fd, NULL, len, SPLICE_F_MOVE);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w <= 0) {
+			gbl_copying = (gbl_copying == COPY_RANGE && w == -1) ? COPY_SPLICE : COPY_NONE;
+			continue;
+		}
+		len -= w;
+		gbl_wstat.copied += w;
+	}
+	return len;
+}
+
+/* writev_all() of `iov`, copying long stretches of the mapped file */
+static int iov_write(int fd, struct iovec *iov, int n) {
+	int done = 0;
+	for (int i = 0; i < n && gbl_copying != COPY_NONE; ++i) {
+		const char *s = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+		if (len < COPYMIN || s < gbl_map || s >= gbl_map + gbl_maplen)
+			continue;
+		if (writev_all(fd, iov + done, i - done) == -1)
+			return -1;
+		size_t left = map_copy(fd, s, len);
+		iov[i].iov_base = (char *) s + len - left;
+		iov[i].iov_len = left;
+		done = i;
+	}
+	return writev_all(fd, iov + done, n - done);
+}
+
+/* Write page `c` to `fd` as it is in the file */
+static int page_write(int fd, const chunk_t *c) {
+	size_t left = map_copy(fd, c->page, c->pagesz);
+	struct iovec iov[2] = {
+		{ (char *) c->page + c->pagesz - left, left },
+		{ "\n", 1 },
+	};
+	/* the last line of a file need not end in a newline */
+	bool nl = c->page[c->pagesz - 1] != '\n';
+	if ((left > 0 || nl) && writev_all(fd, (left > 0) ? iov : iov + 1, (left > 0) + nl) == -1)
+		return -1;
+	page_done(c);
+	return 0;
+}
+
+/* bytes gathered before they are written out */
+#define WRITEBATCH (64 << 20)
+
+ssize_t ll_write(int fd, long from, long to) {
+	static char newline = '\n';
+	struct iovec iov[IOV_MAX];
+	int n = 0;
+	ssize_t total = 0;
+	size_t pending = 0;
+	/* where the batch reads the mapping, pages are dropped once written */
+	const char *lo = NULL, *hi = NULL;
+
+	gbl_wstat = (ll_wstat_t) { 0 };
+	gbl_copying = COPY_RANGE;
+	ll_iter_t it;
+	node_t *node = ll_iter_at(&it, from);
+	for (; from <= to && node != NULL; ++from, node = ll_iter_next(&it)) {
+		/* a whole page in the range is a piece of the file as it was
+		 * loaded and is copied without going through its lines
+		 */
+		chunk_t *c = it.chunk;
+		if (c->page != NULL && it.pos == 0 && from + c->n - 1 <= to) {
+			if (iov_write(fd, iov, n) == -1 || page_write(fd, c) == -1)
+				return -1;
+			if (lo != NULL)
+				map_drop(lo, hi);
+			n = 0;
+			pending = 0;
+			lo = hi = NULL;
+			total += c->pagesz + (c->page[c->pagesz - 1] != '\n');
+			/* on to the page's last line, the next one is past it */
+			from += c->n - 1;
+			it.at += c->n - 1;
+			it.pos = c->n - 1;
+			continue;
+		}
+
+		/* a line of the mapped file still has its newline after it */
+		size_t len = node->len;
+		bool nl = isview(node) && node->s + len < gbl_map + gbl_maplen;
+		if (nl)
+			len++;
+
+		/* lines that follow each other in memory go out as one */
+		if (n > 0 && (char *) iov[n-1].iov_base + iov[n-1].iov_len == node->s) {
+			iov[n-1].iov_len += len;
+		}
+		else {
+			iov[n].iov_base = node->s;
+			iov[n++].iov_len = len;
+		}
+		if (!nl) {
+			iov[n].iov_base = &newline;
+			iov[n++].iov_len = 1;
+			len++;
+		}
+		else if (gbl_pages > 0) {
+			if (lo == NULL || node->s < lo)
+				lo = node->s;
+			if (node->s + len > hi)
+				hi = node->s + len;
+		}
+		total += len;
+		pending += len;
+
+		if (n >= IOV_MAX - 2 || pending >= WRITEBATCH) {
+			if (iov_write(fd, iov, n) == -1)
+				return -1;
+			if (lo != NULL)
+				map_drop(lo, hi);
+			n = 0;
+			pending = 0;
+			lo = hi = NULL;
+		}
+	}
+	if (iov_write(fd, iov, n) == -1)
+		return -1;
+	gbl_wstat.written = total - gbl_wstat.copied;
+	return total;
+}
+
+ll_wstat_t ll_write_stats() {
+	return gbl_wstat;
+}
+
+/* copy the mapped file to `fd` a page of it at a time */
+static int map_dup(int fd) {
+	gbl_copying = COPY_RANGE;
+	for (size_t off = 0; off < gbl_maplen; off += PAGESZ) {
+		size_t len = (gbl_maplen - off < PAGESZ) ? gbl_maplen - off : PAGESZ;
+		size_t left = map_copy(fd, gbl_map + off, len);
+		struct iovec iov = { gbl_map + off + len - left, left };
+		if (left > 0 && writev_all(fd, &iov, 1) == -1)
+			return -1;
+		map_drop(gbl_map + off, gbl_map + off + len);
+	}
+	return 0;
+}
+
+void ll_detach() {
+	if (gbl_map == NULL)
+		return;
+	ll_sync(LONG_MAX);
+	FILE *fp = tmpfile();
+	int fd = (fp != NULL) ? fcntl(fileno(fp), F_DUPFD_CLOEXEC, 0) : -1;
+	if (fp != NULL)
+		fclose(fp);
+	struct stat st;
+	if (fd == -1 || map_dup(fd) == -1 || fstat(fd, &st) == -1)
+		goto fail;
+	/* the copy takes the place of the mapping, every pointer into it
+	 * stays good, the journal's too
+	 */
+	char *map = mmap(NULL, gbl_maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	if (mremap(map, gbl_maplen, gbl_maplen, MREMAP_MAYMOVE | MREMAP_FIXED, gbl_map) == MAP_FAILED) {
+		munmap(map, gbl_maplen);
+		goto fail;
+	}
+	if (gbl_mapfd != -1)
+		close(gbl_mapfd);
+	gbl_mapfd = fd;
+	gbl_mapdev = st.st_dev;
+	gbl_mapino = st.st_ino;
+	gbl_filesize = st.st_size;
+	gbl_filetime = st.st_mtim;
+	return;
+fail:
+	if (fd != -1)
+		close(fd);
+	ll_unmap();
+}
+
+/* bytes of the file ll_patch() is to write */
+typedef struct {
+	off_t off;
+	const char *s;
+	size_t len;
+}patch_t;
+
+typedef struct {
+	patch_t *p;
+	long n, cap;
+}patches_t;
+
+/* add the `len` bytes at `s` to be written at `off` */
+static void patch_add(patches_t *ps, off_t off, const char *s, size_t len) {
+	patch_t *last = (ps->n > 0) ? &ps->p[ps->n - 1] : NULL;
+	if (last != NULL && last->off + (off_t) last->len == off && last->s + last->len == s) {
+		last->len += len;
+		return;
+	}
+	if (ps->n == ps->cap)
+		ps->p = jgrow(ps->p, &ps->cap, sizeof(patch_t));
+	ps->p[ps->n++] = (patch_t) { off, s, len };
+}
+
+/* true if the mapped bytes `from` to `to` meet one of the `ps` */
+static bool patched(const patches_t *ps, off_t from, off_t to) {
+	long lo = 0, hi = ps->n;
+	while (lo < hi) {
+		long mid = (lo + hi) / 2;
+		if (ps->p[mid].off + (off_t) ps->p[mid].len <= from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < ps->n && ps->p[lo].off < to;
+}
+
+/* Give the journal's old lines that view bytes about to be overwritten,
+ * or cut off past `size`, text of their own so undo still has them.
+ */
+static void patch_journal(const patches_t *ps, off_t size) {
+	jstep_t *stacks[2] = { gbl_journal.undo, gbl_journal.redo };
+	long sizes[2] = { gbl_journal.nundo, gbl_journal.nredo };
+	for (int k = 0; k < 2; ++k) {
+		for (long i = 0; i < sizes[k]; ++i) {
+			jstep_t *step = &stacks[k][i];
+			for (long j = 0; j < step->n; ++j) {
+				jrec_t *r = &step->recs[j];
+				for (long l = 0; r->nodes != NULL && l < r->n; ++l) {
+					node_t *node = &r->nodes[l];
+					off_t off = node->s - gbl_map;
+					if (isview(node) && (off + (off_t) node->len > size ||
+								patched(ps, off, off + node->len)))
+						ll_make_node(node, node->s, node->len);
+				}
+			}
+		}
+	}
+}
+
+/* pwritev() all of the `n` patches from `p` on, which follow each other */
+static int patch_write(int fd, const patch_t *p, int n) {
+	struct iovec iov[IOV_MAX];
+	for (int i = 0; i < n; ++i) {
+		iov[i].iov_base = (char *) p[i].s;
+		iov[i].iov_len = p[i].len;
+	}
+	off_t off = p[0].off;
+	struct iovec *v = iov;
+	while (n > 0) {
+		ssize_t w = pwritev(fd, v, n, off);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		off += w;
+		for (; n > 0 && (size_t) w >= v->iov_len; ++v, --n)
+			w -= v->iov_len;
+		if (n > 0) {
+			v->iov_base = (char *) v->iov_base + w;
+			v->iov_len -= w;
+		}
+	}
+	return 0;
+}
+
+ssize_t ll_patch(int fd) {
+	static const char newline = '\n';
+	struct stat st;
+	if (gbl_map == NULL || fstat(fd, &st) == -1 || st.st_dev != gbl_mapdev ||
+			st.st_ino != gbl_mapino || st.st_size != gbl_filesize ||
+			st.st_mtim.tv_sec != gbl_filetime.tv_sec ||
+			st.st_mtim.tv_nsec != gbl_filetime.tv_nsec)
+		return -2;
+
+	/* Walk the buffer working out where each line goes. Lines of the
+	 * file still where they were stay, anything else is written over
+	 * what was there, which no line may be viewing.
+	 */
+	patches_t ps = { 0 };
+	off_t off = 0;
+	size_t written = 0;
+	int pos;
+	for (chunk_t *c = (gbl_len > 0) ? find(1, &pos) : NULL; c != NULL; c = chunk_next(c)) {
+		if (c->page != NULL) {
+			if (c->page - gbl_map != off)
+				goto moved;
+			off += c->pagesz;
+			if (c->page[c->pagesz - 1] != '\n') {
+				patch_add(&ps, off++, &newline, 1);
+				written++;
+			}
+			continue;
+		}
+		for (int i = 0; i < c->n; ++i) {
+			node_t *node = &c->lines[i];
+			if (isview(node)) {
+				if (node->s - gbl_map != off)
+					goto moved;
+				off += node->len;
+				if (node->s + node->len < gbl_map + gbl_maplen) {
+					off++;
+					continue;
+				}
+			}
+			else {
+				patch_add(&ps, off, node->s, node->len);
+				off += node->len;
+				written += node->len;
+			}
+			patch_add(&ps, off++, &newline, 1);
+			written++;
+		}
+	}
+	/* a rewrite is about as cheap and leaves no half written file */
+	if (written > (size_t) off / 2)
+		goto moved;
+
+	patch_journal(&ps, off);
+
+	for (long i = 0; i < ps.n; ) {
+		long j = i + 1;
+		while (j < ps.n && j - i < IOV_MAX &&
+				ps.p[j].off == ps.p[j-1].off + (off_t) ps.p[j-1].len)
+			j++;
+		if (patch_write(fd, ps.p + i, j - i) == -1)
+			goto fail;
+		i = j;
+	}
+	if (off < st.st_size && ftruncate(fd, off) == -1)
+		goto fail;
+	free(ps.p);
+
+	if (fstat(fd, &st) == 0) {
+		gbl_filesize = st.st_size;
+		gbl_filetime = st.st_mtim;
+	}
+	gbl_wstat = (ll_wstat_t) { .written = written, .kept = off - written };
+	return off;
+moved:
+	free(ps.p);
+	return -2;
+fail:
+	free(ps.p);
+	return -1;
+}
+
+/* ranges shorter than this aren't worth another thread */
+#define SEARCHMIN 16384
+
+/* a search split over the pool, one part per task */
+struct search {
+	buffer_t *buffer;	/* the lines are its */
+	const char *pattern;
+	int cflags;
+	long from, to;
+	long max;
+	int parts;
+	regbuf_t *res;		/* the matches of every part */
+};
+
+static void search_part(void *arg, int i) {
+	struct search *sr = arg;
+	regbuf_t *rb = &sr->res[i];
+	long from, to;
+	long cap = 0;
+
+	ll_buffer_use(sr->buffer);
+	pool_slice(sr->from, sr->to, sr->parts, i, &from, &to);
+
+	re_t *re = re_compile(sr->pattern, sr->cflags);
+	if (re == NULL) {
+		rb->size = -1;
+		return;
+	}
+	uint64_t start = STATS_START();
+	long first = from;
+	size_t bytes = 0;
+	ll_iter_t it;
+	node_t *node = ll_iter_at(&it, from);
+	for (; from <= to; ++from, node = ll_iter_next(&it)) {
+		regmatch_t m = { .rm_so = 0, .rm_eo = node->len };
+		bytes += node->len;
+		if (re_exec(re, node->s, 1, &m, 0) != 0)
+			continue;
+		if (rb->size == cap) {
+			long *buf = realloc(rb->buf, (cap = cap * 2 + 64) * sizeof(long));
+			if (buf == NULL) {
+				rb->size = -1;
+				return;
+			}
+			rb->buf = buf;
+		}
+		rb->buf[rb->size++] = from;
+		if (rb->size == sr->max) {
+			from++;
+			break;
+		}
+	}
+	STATS_STOP(STAT_REGEXEC, start, from - first, bytes);
+}
+
+regbuf_t *ll_reg_search(long from, long to, const char *pattern, long max) {
+	uint64_t start = STATS_START();
+	/* compiled here first so errors are reported and the pattern
+	 * becomes the last one, the workers compile their own from it
+	 */
+	re_get(pattern, REG_EXTENDED | REG_NOSUB);
+	struct search sr = {
+		.buffer = gbl_buffer,
+		.pattern = re_last(),
+		.cflags = REG_EXTENDED | REG_NOSUB,
+		.from = from,
+		.to = to,
+		.max = max,
+	};
+	long n = to - from + 1;
+	sr.parts = pool_parts(n, SEARCHMIN);
+
+	regbuf_t *rbuf = calloc(1, sizeof(regbuf_t));
+	if (rbuf == NULL || (sr.res = calloc(sr.parts, sizeof(regbuf_t))) == NULL) {
+		free(rbuf);
+		io_err("calloc: %s\n", strerror(errno));
+	}
+	if (n > 0)
+		pool_run(sr.parts, search_part, &sr);
+
+	/* stitch the parts together in order */
+	long total = 0;
+	bool failed = false;
+	for (int i = 0; i < sr.parts; ++i) {
+		failed |= sr.res[i].size == -1;
+		total += sr.res[i].size;
+	}
+	if (!failed && total > 0 && (rbuf->buf = malloc(total * sizeof(long))) == NULL)
+		failed = true;
+	for (int i = 0; i < sr.parts; ++i) {
+		if (!failed && (max == 0 || rbuf->size < max)) {
+			long k = sr.res[i].size;
+			if (max != 0 && k > max - rbuf->size)
+				k = max - rbuf->size;
+			if (k > 0)
+				memcpy(rbuf->buf + rbuf->size, sr.res[i].buf, k * sizeof(long));
+			rbuf->size += k;
+		}
+		free(sr.res[i].buf);
+	}
+	free(sr.res);
+	if (failed) {
+		ll_regbuf_free(rbuf);
+		io_err("Out of memory\n");
+	}
+	STATS_STOP(STAT_SEARCH, start, 1, 0);
+	return rbuf;
+}
+
+void ll_regbuf_free(regbuf_t *rbuf) {
+	if (rbuf != NULL)
+		free(rbuf->buf);
+	free(rbuf);
+}
+
+/* recount the marks of the subtree at `c`, the chunks' own are right */
+static long gsum(chunk_t *c) {
+	if (c == NULL)
+		return 0;
+	c->gmarks = gsum(c->left) + c->ngmark + gsum(c->right);
+	return c->gmarks;
+}
+
+void ll_gmark(long from, long to, const long *lines, long n, bool invert) {
+	ll_iter_t it;
+	long j = 0;
+	if (ll_iter_at(&it, from) == NULL)
+		return;
+	for (long at = from; at <= to; ++at) {
+		bool match = j < n && lines[j] == at;
+		if (match)
+			j++;
+		if (match != invert && it.chunk->page != NULL) {
+			/* lines of a page get nodes to carry the mark */
+			page_decode(at);
+			ll_iter_at(&it, at);
+		}
+		if (match != invert && !gbit(it.chunk, it.pos)) {
+			it.chunk->gmark[it.pos / 64] |= (uint64_t) 1 << (it.pos % 64);
+			it.chunk->ngmark++;
+		}
+		if (at < to)
+			ll_iter_next(&it);
+	}
+	gsum(gbl_root);
+}
+
+long ll_gnext() {
+	chunk_t *c = gbl_root;
+	long base = 0;
+	while (c != NULL && c->gmarks > 0) {
+		if (gmarks(c->left) > 0) {
+			c = c->left;
+			continue;
+		}
+		base += weight(c->left);
+		if (c->ngmark == 0) {
+			base += c->n;
+			c = c->right;
+			continue;
+		}
+		int w = 0;
+		while (c->gmark[w] == 0)
+			w++;
+		int pos = w * 64 + __builtin_ctzll(c->gmark[w]);
+		c->gmark[w] &= c->gmark[w] - 1;
+		c->ngmark--;
+		fixup(c);
+		return base + pos + 1;
+	}
+	return 0;
+}
+
+static void gclear(chunk_t *c) {
+	if (c == NULL || c->gmarks == 0)
+		return;
+	gclear(c->left);
+	gclear(c->right);
+	memset(c->gmark, 0, sizeof(c->gmark));
+	c->ngmark = 0;
+	c->gmarks = 0;
+}
+
+void ll_gclear() {
+	gclear(gbl_root);
+}
+
+/* Make the change `r` records and turn it into the record that reverses it */
+static void japply(jrec_t *r) {
+	size_t before = jrec_bytes(r);
+	if (r->op == 'd') {
+		r->cap = r->n;
+		if (!(r->nodes = malloc(r->n * sizeof(node_t))))
+			io_err("malloc: %s\n", strerror(errno));
+		ll_iter_t it;
+		node_t *node = ll_iter_at(&it, r->at);
+		for (long i = 0; i < r->n; ++i, node = ll_iter_next(&it))
+			r->nodes[i] = *node;
+		ll_remove_range(r->at, r->at + r->n - 1);
+		r->op = 'a';
+	}
+	else if (r->op == 'a') {
+		insert_nodes(r->at - 1, r->nodes, r->n);
+		free(r->nodes);
+		r->nodes = NULL;
+		r->cap = 0;
+		r->op = 'd';
+	}
+	else if (r->op == 'm') {
+		long at = r->at, to = r->to;
+		move_lines(at, at + r->n - 1, to);
+		/* moved back, where they are now and what to move them after */
+		if (to < at) {
+			r->at = to + 1;
+			r->to = at - 1 + r->n;
+		}
+		else {
+			r->at = to - r->n + 1;
+			r->to = at - 1;
+		}
+	}
+	else {
+		ll_iter_t it;
+		long at = r->lines[0];
+		node_t *node = ll_iter_at(&it, at);
+		for (long i = 0; i < r->n; ++i) {
+			/* step over short gaps, look far ones up */
+			if (r->lines[i] - at > CHUNKLIM) {
+				at = r->lines[i];
+				node = ll_iter_at(&it, at);
+			}
+			for (; at < r->lines[i]; ++at)
+				node = ll_iter_next(&it);
+			if (it.chunk->page != NULL) {
+				page_decode(at);
+				node = ll_iter_at(&it, at);
+			}
+			node_t old = *node;
+			*node = r->nodes[i];
+			r->nodes[i] = old;
+		}
+	}
+	gbl_journal.bytes += jrec_bytes(r);
+	gbl_journal.bytes -= before;
+}
+
+/* reverse the last step of `from` and push what reverses that onto `to` */
+static int jreplay(jstep_t *from, long *nfrom, jstep_t **to, long *nto, long *capto) {
+	if (*nfrom == 0)
+		return -1;
+	jstep_t step = from[--*nfrom];
+	long line = gbl_current_line;
+
+	gbl_journal.replaying = true;
+	gbl_journal.open = false;
+	/* the records are reversed last to first, which is the order
+	 * the reversing ones have to go back in
+	 */
+	for (long i = 0, j = step.n - 1; i < j; ++i, --j) {
+		jrec_t t = step.recs[i];
+		step.recs[i] = step.recs[j];
+		step.recs[j] = t;
+	}
+	for (long i = 0; i < step.n; ++i)
+		japply(&step.recs[i]);
+	gbl_journal.replaying = false;
+
+	gbl_current_line = (step.line <= gbl_len) ? step.line : gbl_len;
+	step.line = line;
+	jpush(to, nto, capto, step);
+	state.saved = false;
+	return 0;
+}
+
+int ll_undo() {
+	return jreplay(gbl_journal.undo, &gbl_journal.nundo,
+			&gbl_journal.redo, &gbl_journal.nredo, &gbl_journal.capredo);
+}
+
+int ll_redo() {
+	return jreplay(gbl_journal.redo, &gbl_journal.nredo,
+			&gbl_journal.undo, &gbl_journal.nundo, &gbl_journal.capundo);
+}
+
+void ll_step() {
+	/* the step that ends gives back the room it had to grow */
+	if (gbl_journal.open && !gbl_journal.off && gbl_journal.nundo > 0) {
+		jstep_t *step = &gbl_journal.undo[gbl_journal.nundo - 1];
+		for (long i = 0; i < step->n; ++i) {
+			jrec_t *r = &step->recs[i];
+			/* 'd' records have no nodes to shrink */
+			if (r->nodes == NULL || r->cap == r->n)
+				continue;
+			size_t before = jrec_bytes(r);
+			node_t *nodes = realloc(r->nodes, r->n * sizeof(node_t));
+			long *lines = (r->lines) ? realloc(r->lines, r->n * sizeof(long)) : NULL;
+			if (nodes != NULL)
+				r->nodes = nodes;
+			if (lines != NULL)
+				r->lines = lines;
+			if (nodes != NULL && (lines != NULL || r->lines == NULL)) {
+				r->cap = r->n;
+				gbl_journal.bytes += jrec_bytes(r);
+				gbl_journal.bytes -= before;
+			}
+		}
+	}
+	gbl_journal.open = false;
+}
+
+void ll_journal_clear() {
+	jstack_clear(gbl_journal.undo, &gbl_journal.nundo);
+	jstack_clear(gbl_journal.redo, &gbl_journal.nredo);
+	gbl_journal.open = false;
+}
+
+void ll_journal_limit(size_t bytes) {
+	gbl_journal.limit = bytes;
+	if (bytes == 0)
+		ll_journal_clear();
+	else
+		jtrim();
+}
+
+size_t ll_journal_bytes() {
+	return gbl_journal.bytes;
+}
@@ -0,0 +1,231 @@
+#ifndef LL_H
+#define LL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "ed.h"
+
+/* The buffer is a rope of chunks: every chunk holds up to CHUNKLIM
+ * consecutive lines and the chunks are kept in a treap ordered by
+ * position, each caching the number of lines in its subtree. Finding,
+ * adding and removing a line are O(log n) and lines are addressed by
+ * their number, 1 to gbl_len. Line 0 is the position before the first
+ * line (e.g. 0a).
+ */
+
+/* Lines per chunk */
+#define CHUNKLIM 256
+
+/* A line, without its newline. Records live inside the chunk that holds
+ * them, so a node_t pointer is only good until the next change to the list.
+ * Text is not NUL terminated and may contain NULs, always go by `len`.
+ */
+typedef struct node {
+	char *s;
+	size_t len;
+}node_t;
+
+typedef struct chunk chunk_t;
+
+/* Walks the list in order without a lookup per line */
+typedef struct {
+	chunk_t *chunk;
+	int pos;
+	long at;		/* the line it is at */
+	unsigned long gen;	/* gbl_gen when it was set, see ll.c */
+	node_t node;		/* the line, when it is in a page */
+}ll_iter_t;
+
+typedef struct regbuf {
+	long *buf;
+	long size;
+}regbuf_t;
+
+/* of the calling thread's current buffer */
+#define gbl_len (gbl_buffer->len)
+#define gbl_current_line (gbl_buffer->current_line)
+
+/* Buffers. Each has a list, file, marks and journal of its own and the
+ * functions below work on the calling thread's current one, so threads
+ * can edit a buffer each at the same time. A thread starts out with the
+ * buffer there is from the start. One buffer is never used by two threads
+ * at once, but for the tasks of the pool reading it (see ll_reg_search()).
+ */
+/* an empty buffer with the options (sync, patch, script) of the current
+ * one, NULL without the memory for it
+ */
+buffer_t *ll_buffer_new();
+/* make `b` the calling thread's current buffer */
+void ll_buffer_use(buffer_t *b);
+/* free `b` and everything in it, it mustn't be current in any thread */
+void ll_buffer_free(buffer_t *b);
+
+/* List manipulation (ll_ prefix stands for linked list) */
+long ll_add_begin(const char *s, size_t len);
+long ll_add_end(const char *s, size_t len);
+/* add a copy of `s` after line `at`, returns the new line's number */
+long ll_add_node(long at, const char *s, size_t len);
+
+long ll_remove_begin();
+long ll_remove_end();
+/* both return the number of the line that took the place of the removed */
+long ll_remove_node(long at);
+long ll_remove_range(long from, long to);
+
+/* replace the text of line `at` with `s`, which must come from ll_alloc() */
+void ll_replace(long at, char *s, size_t len);
+/* the same for `node`, which is line `at` */
+void ll_node_set(long at, node_t *node, char *s, size_t len);
+/* room for a line of `len` bytes, it lasts until ll_free() */
+char *ll_alloc(size_t len);
+/* hand the `len` bytes of malloc()ed text at `buf` over to the arena */
+void ll_adopt(char *buf, size_t len);
+
+/* Line `at`. A line of a page is read into a node of the calling thread,
+ * which the next ll_at() reuses.
+ */
+node_t *ll_at(long at);
+
+/* point `it` at line `at` and return it, NULL when out of range */
+node_t *ll_iter_at(ll_iter_t *it, long at);
+/* advance to the next line, NULL past the last */
+node_t *ll_iter_next(ll_iter_t *it);
+
+/* Add the lines in `buf` after line `at`, either as copies or as views
+ * into `buf`. Newlines are found with scan_newlines() and the lines are
+ * put in chunks before they are spliced in, so there is no lookup per
+ * line. Returns the number of lines added.
+ */
+long ll_add_lines(long at, const char *buf, size_t size, bool copy);
+/* Append the lines of the regular file `fd` as views into a private
+ * mapping of it. Returns the number of lines or -1 if it can't be mapped.
+ * Files bigger than the page limit are paged: the list keeps where every
+ * page of about a megabyte starts and how many lines it has rather than
+ * a node per line, so a file takes memory for its index, the pages read
+ * last and whatever was changed, not for its size. Lines of a page are
+ * read straight out of the mapping and a page gets nodes the first time
+ * one of its lines is changed or marked.
+ */
+long ll_map_file(int fd);
+/* page files bigger than `bytes`, 1 GB by default, keeping no more than
+ * that of their pages cached
+ */
+void ll_page_limit(size_t bytes);
+/* Load files in the background from now on: ll_map_file() returns once
+ * the first few hundred kilobytes are in and a thread reads the rest,
+ * which comes in at the end of the list with every ll_sync(). Until then
+ * the list is the part read so far and commands that go past it have to
+ * wait for more. Loading is not a change, it isn't journaled.
+ */
+void ll_background(bool on);
+/* take in what the loader has read, waiting until there are `line` lines
+ * or the file is all in; LONG_MAX waits for all of it, 0 for nothing
+ */
+void ll_sync(long line);
+/* true while a file is being loaded in the background */
+bool ll_loading();
+/* copy the lines still viewing the mapped file and unmap it */
+void ll_unmap();
+/* Move the mapping off its file onto a copy of it in the temporary
+ * directory, so the file can be rewritten in place under the lines still
+ * viewing it. The copy is made a page at a time and nothing is decoded;
+ * if it can't be made the file is unmapped with ll_unmap().
+ */
+void ll_detach();
+/* true if `filename` is the file currently mapped */
+bool ll_ismapped(const char *filename);
+
+/* Move the lines from `from` to `to` after line `at`, which can't be
+ * one of them but the last, by cutting them out of the list and linking
+ * them back in: O(log n) whatever the number of lines. Returns the new
+ * number of the last one.
+ */
+long ll_move(long from, long to, long at);
+/* Put copies of the lines from `from` to `to` after line `at`. The copies
+ * share their text with the originals, which is never changed in place,
+ * so only the nodes are copied. Returns the number of the last copy.
+ */
+long ll_copy(long from, long to, long at);
+
+/* Write lines `from` to `to`, each followed by a newline, to `fd`.
+ * Lines are gathered into writev() batches and lines that sit next to
+ * each other in memory, like an unchanged stretch of the mapped file,
+ * go out as one piece. Whole pages nobody changed are copied from the
+ * file by the kernel. Returns the bytes written or -1.
+ */
+ssize_t ll_write(int fd, long from, long to);
+/* Write the whole list over the mapped file, open for writing in `fd`,
+ * in place: changed lines are written where they go and the rest of the
+ * file stays as it is. Every unchanged line has to be where it was, so
+ * it works for changes that keep the size of the lines, and for lines
+ * added or removed at the end. Returns the file's new size, -1 on errors
+ * or -2, with the file left alone, if it can't be patched that way, is
+ * mostly changed or was changed by someone else since it was loaded.
+ */
+ssize_t ll_patch(int fd);
+
+/* What the last ll_write() or ll_patch() did with the file's bytes */
+typedef struct {
+	size_t written;	/* from memory */
+	size_t copied;	/* by the kernel from the mapped file */
+	size_t kept;	/* left where they were by ll_patch() */
+}ll_wstat_t;
+
+ll_wstat_t ll_write_stats();
+
+/* Undo. The changes made between two ll_step()s are one step, recorded
+ * as they are made by the functions above as what it takes to reverse
+ * them. Old text is shared rather than copied, so a step costs about 16
+ * bytes for every line it added, removed or changed. The oldest steps go
+ * once the journal holds more than its limit.
+ */
+void ll_step();
+/* reverse the last step or the last undo, -1 if there is none */
+int ll_undo();
+int ll_redo();
+void ll_journal_clear();
+/* 0 turns undo off */
+void ll_journal_limit(size_t bytes);
+size_t ll_journal_bytes();
+
+void ll_free(); /* Free the entire list, O(blocks) rather than O(lines) */
+void ll_print(); /* For debugging mainly */
+
+/* Lines from `from` to `to` matching `pattern` (extended syntax, an
+ * empty one is the last pattern), in order, and no more than `max` of
+ * them unless it is 0. Long ranges are split over the threads of the
+ * pool and the parts' matches put back together in order.
+ */
+regbuf_t *ll_reg_search(long from, long to, const char *pattern, long max);
+void ll_regbuf_free(regbuf_t *rbuf);
+
+/* Marks for g and v: a bit per line kept in the line's chunk, so marks
+ * move with their lines, lines added later are never marked and removed
+ * ones take their mark along. Marking is a walk over the range and
+ * taking the next mark is O(log n).
+ */
+/* mark the lines from `from` to `to` that are among the `n` ascending
+ * `lines`, or with `invert` those that aren't
+ */
+void ll_gmark(long from, long to, const long *lines, long n, bool invert);
+/* unmark the first marked line and return it, 0 when none is left */
+long ll_gnext();
+void ll_gclear();
+
+/*
+ * Maximum [book]marks
+ * From '!' (dec 33) to '~' (dec 126)
+ * 126 - 33 + 1 = 94
+ */
+#define MARKLIM 94
+
+/* Marks hold line numbers (0 when unset) and follow their line as lines
+ * before it are added or removed.
+ */
+int markset(long at, int c);
+long markget(int c);
+void markclear(int c);
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "out.h"
+#include "scan.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct {
+	char buf[OUTBUF];
+	size_t used;
+	struct iovec iov[IOV_MAX];
+	int n;
+	bool refs;	/* some of iov points at lines rather than buf */
+}writer_t;
+
+/* Every thread that prints (the batch mode's run a buffer each) has a
+ * writer of its own, made the first time, and the writes of one flush
+ * don't mix with another thread's.
+ */
+static _Thread_local writer_t *out;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the calling thread's writer, NULL without the memory for it */
+static writer_t *writer() {
+	if (out == NULL && (out = malloc(sizeof(writer_t))) != NULL) {
+		out->used = 0;
+		out->n = 0;
+		out->refs = false;
+	}
+	return out;
+}
+
+/* add the `len` bytes at `s` to the batch, as part of the last piece
+ * if they follow it in memory
+ */
+static void iov_add(writer_t *w, const char *s, size_t len) {
+	if (w->n > 0) {
+		struct iovec *last = &w->iov[w->n - 1];
+		if ((char *) last->iov_base + last->iov_len == s) {
+			last->iov_len += len;
+			return;
+		}
+	}
+	w->iov[w->n++] = (struct iovec) { (void *) s, len };
+}
+
+void out_put(const char *s, size_t len) {
+	if (len == 0)
+		return;
+	writer_t *w = writer();
+	if (w == NULL) {
+		/* unbuffered then, through stdio */
+		fwrite(s, 1, len, stdout);
+		return;
+	}
+	if (len >= OUTREF) {
+		if (w->n == IOV_MAX)
+			out_flush();
+		iov_add(w, s, len);
+		w->refs = true;
+		return;
+	}
+	if (w->used + len > OUTBUF || w->n == IOV_MAX)
+		out_flush();
+	memcpy(w->buf + w->used, s, len);
+	iov_add(w, w->buf + w->used, len);
+	w->used += len;
+}
+
+void out_char(int c) {
+	char ch = c;
+	out_put(&ch, 1);
+}
+
+void out_number(long n, int width) {
+	char buf[32];
+	char *p = buf + sizeof(buf);
+	unsigned long u = (n < 0) ? -(unsigned long) n : (unsigned long) n;
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u > 0);
+	if (n < 0)
+		*--p = '-';
+	int len = buf + sizeof(buf) - p;
+	out_put(p, len);
+	for (; len < width; ++len)
+		out_char(' ');
+}
+
+void out_line(const char *s, size_t len) {
+	out_put(s, len);
+	out_char('\n');
+}
+
+/* `c` escaped into `esc`, returns its length */
+static int escape(unsigned char c, char *esc) {
+	char letter = 0;
+	switch (c) {
+		case '\\': letter = '\\'; break;
+		case '\a': letter = 'a'; break;
+		case '\b': letter = 'b'; break;
+		case '\f': letter = 'f'; break;
+		case '\n': letter = 'n'; break;
+		case '\r': letter = 'r'; break;
+		case '\t': letter = 't'; break;
+		case '\v': letter = 'v'; break;
+	}
+	esc[0] = '\\';
+	if (letter != 0) {
+		esc[1] = letter;
+		return 2;
+	}
+	esc[1] = '0' + (c >> 6);
+	esc[2] = '0' + ((c >> 3) & 7);
+	esc[3] = '0' + (c & 7);
+	return 4;
+}
+
+void out_list(const char *s, size_t len) {
+	const char *end = s + len;
+	int col = 0;
+	while (s < end) {
+		const char *e = scan_unprintable(s, end);
+		while (s < e) {
+			if (col == LISTWIDTH - 1) {
+				out_put("\\\n", 2);
+				col = 0;
+			}
+			size_t k = LISTWIDTH - 1 - col;
+			if ((size_t) (e - s) < k)
+				k = e - s;
+			out_put(s, k);
+			s += k;
+			col += k;
+		}
+		if (s == end)
+			break;
+		char esc[4];
+		int k = escape(*s++, esc);
+		if (col + k > LISTWIDTH - 1) {
+			out_put("\\\n", 2);
+			col = 0;
+		}
+		out_put(esc, k);
+		col += k;
+	}
+	out_put("$\n", 2);
+}
+
+void out_done() {
+	if (out != NULL && out->refs)
+		out_flush();
+}
+
+void out_flush() {
+	if (out == NULL || out->n == 0)
+		return;
+	fflush(stdout);
+	struct iovec *iov = out->iov;
+	int n = out->n;
+	pthread_mutex_lock(&lock);
+	while (n > 0) {
+		ssize_t w = writev(STDOUT_FILENO, iov, n);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			/* nowhere to go, like stdio's output */
+			break;
+		}
+		for (; n > 0 && (size_t) w >= iov->iov_len; ++iov, --n)
+			w -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	out->n = 0;
+	out->used = 0;
+	out->refs = false;
+}
@@ -0,0 +1,38 @@
+#ifndef OUT_H
+#define OUT_H
+
+#include <stddef.h>
+
+/* Output of p, n and l. Lines are gathered into a buffer of the calling
+ * thread's and writev() batches that go to stdout's descriptor when the
+ * buffer fills, instead of through stdio a call at a time: short lines
+ * and line numbers are copied into the buffer, long lines go out from
+ * where they are. Nothing is written until out_flush(), which has to come
+ * before anything else is printed to stdout, and out_done() before the
+ * lines can change.
+ */
+
+#define OUTBUF (1 << 20)	/* bytes buffered */
+#define OUTREF 512		/* lines this long aren't copied */
+#define LISTWIDTH 72		/* columns of l, the \ folding a line included */
+
+/* the `len` bytes at `s` */
+void out_put(const char *s, size_t len);
+void out_char(int c);
+/* `n` in decimal, padded with spaces on the right to `width` columns */
+void out_number(long n, int width);
+/* the `len` bytes of a line at `s` and a newline */
+void out_line(const char *s, size_t len);
+/* The same as l prints it: \\, C escapes like \t and octal ones like \302
+ * for the bytes that aren't printable ASCII, folded with a \ at the end
+ * of every LISTWIDTH columns and ending in $. Runs of bytes that need no
+ * escape are found with scan_unprintable().
+ */
+void out_list(const char *s, size_t len);
+
+/* the lines put out are about to change, flush them if they weren't copied */
+void out_done();
+/* stdio's output, then the buffer's if there is any */
+void out_flush();
+
+#endif
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "ed.h"
+#include "ll.h"
+#include "out.h"
+#include "pipe.h"
+
+extern char **environ;
+
+/* bytes read from the command at a time, the buffer grows by doubling */
+#define READBLK (1 << 20)
+
+typedef struct {
+	buffer_t *buffer;	/* the lines are its */
+	int fd;
+	long from, to;
+}feed_t;
+
+/* The lines into the command's input. A command that stops reading
+ * before the end (head) makes the writes fail with SIGPIPE blocked
+ * rather than end the editor, the signal goes with the thread.
+ */
+static void *feed(void *arg) {
+	feed_t *f = arg;
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	ll_buffer_use(f->buffer);
+	ll_write(f->fd, f->from, f->to);
+	close(f->fd);
+	return NULL;
+}
+
+/* all of `fd` in a malloc()ed buffer, NULL without the memory for it */
+static char *drain(int fd, size_t *size) {
+	size_t cap = READBLK;
+	size_t len = 0;
+	char *buf = malloc(cap);
+	while (buf != NULL) {
+		if (len == cap) {
+			char *nbuf = realloc(buf, cap *= 2);
+			if (nbuf == NULL) {
+				free(buf);
+				return NULL;
+			}
+			buf = nbuf;
+		}
+		ssize_t r = read(fd, buf + len, cap - len);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		len += r;
+	}
+	*size = len;
+	/* the list keeps it, without the room it didn't use */
+	if (buf != NULL && len < cap) {
+		char *nbuf = realloc(buf, (len > 0) ? len : 1);
+		if (nbuf != NULL)
+			buf = nbuf;
+	}
+	return buf;
+}
+
+char *pipe_run(const char *cmd, long from, long to, size_t *size) {
+	int in[2] = { -1, -1 };
+	int out[2] = { -1, -1 };
+	if ((from > 0 && pipe2(in, O_CLOEXEC) == -1) ||
+			(size != NULL && pipe2(out, O_CLOEXEC) == -1)) {
+		int err = errno;
+		if (in[0] != -1) {
+			close(in[0]);
+			close(in[1]);
+		}
+		io_err("pipe: %s\n", strerror(err));
+	}
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	if (from > 0)
+		posix_spawn_file_actions_adddup2(&fa, in[0], STDIN_FILENO);
+	if (size != NULL)
+		posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+
+	/* what was printed so far comes before what the command prints */
+	out_flush();
+	fflush(stdout);
+	char *argv[] = { "sh", "-c", (char *) cmd, NULL };
+	pid_t pid;
+	int err = posix_spawn(&pid, "/bin/sh", &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if (from > 0)
+		close(in[0]);
+	if (size != NULL)
+		close(out[1]);
+	if (err != 0) {
+		if (from > 0)
+			close(in[1]);
+		if (size != NULL)
+			close(out[0]);
+		io_err("posix_spawn: %s\n", strerror(err));
+	}
+
+	pthread_t thread;
+	feed_t f = { gbl_buffer, in[1], from, to };
+	bool fed = false;
+	if (from > 0) {
+		if ((err = pthread_create(&thread, NULL, feed, &f)) == 0)
+			fed = true;
+		else
+			/* it gets no input rather than waiting for it */
+			close(in[1]);
+	}
+	char *buf = NULL;
+	if (size != NULL) {
+		buf = drain(out[0], size);
+		close(out[0]);
+	}
+	if (fed)
+		pthread_join(thread, NULL);
+	int status = 0;
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+
+	if (from > 0 && !fed) {
+		free(buf);
+		io_err("pthread_create: %s\n", strerror(err));
+	}
+	if (size != NULL && buf == NULL)
+		io_err("malloc: %s\n", strerror(ENOMEM));
+	/* what a command that failed printed doesn't go into the buffer */
+	if (WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) != 0)) {
+		free(buf);
+		if (WIFSIGNALED(status))
+			io_err("%s: killed by signal %d\n", cmd, WTERMSIG(status));
+		io_err("%s: exit status %d\n", cmd, WEXITSTATUS(status));
+	}
+	return buf;
+}
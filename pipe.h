@@ -0,0 +1,23 @@
+#ifndef PIPE_H
+#define PIPE_H
+
+#include <stddef.h>
+
+/* Shell commands: !cmd, r !cmd, e !cmd, w !cmd and a range filtered with
+ * 1,$!cmd. The command runs under /bin/sh -c, started by posix_spawn().
+ * Lines go into it with ll_write() from a thread of their own, so the
+ * stretches of the mapped file nobody changed are spliced into the pipe by
+ * the kernel, while the editor reads what comes out in large blocks into
+ * one buffer, which the list adopts rather than copies.
+ */
+
+/* Run `cmd` with lines `from` to `to` on its input, or the editor's input
+ * if `from` is 0. With `size` NULL the command prints to the editor's
+ * output and NULL is returned, otherwise its output is returned in a
+ * malloc()ed buffer of `size` bytes. Errors go to io_err(), and so does a
+ * command that exits with a status other than 0 or is killed, before
+ * anything of its output is returned.
+ */
+char *pipe_run(const char *cmd, long from, long to, size_t *size);
+
+#endif
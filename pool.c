@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+/* never more than this many threads, however many CPUs there are */
+#define POOLMAX 64
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a job was posted or the pool is stopping */
+	pthread_cond_t done;	/* the last worker left the job */
+	pthread_t threads[POOLMAX];
+	int size;		/* threads, counting the caller of pool_run() */
+	int started;		/* workers running */
+	bool stop;
+
+	/* the current job */
+	unsigned long job;	/* bumped for every new one */
+	void (*fn)(void *, int);
+	void *arg;
+	int n;
+	int next;		/* next task to hand out */
+	int busy;		/* workers that haven't left it yet */
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* set while the thread runs a task, the jobs it starts run right there */
+static _Thread_local bool intask;
+
+/* run tasks of the current job until there are none left, with the lock held */
+static void drain() {
+	while (pool.next < pool.n) {
+		int i = pool.next++;
+		pthread_mutex_unlock(&pool.lock);
+		intask = true;
+		pool.fn(pool.arg, i);
+		intask = false;
+		pthread_mutex_lock(&pool.lock);
+	}
+}
+
+/* `job` is the last job posted before the worker was started */
+static void *worker(void *job) {
+	unsigned long seen = (uintptr_t) job;
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.stop && pool.job == seen)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		if (pool.stop)
+			break;
+		seen = pool.job;
+		drain();
+		if (--pool.busy == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static void pool_stop() {
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	for (int i = 0; i < pool.started; ++i)
+		pthread_join(pool.threads[i], NULL);
+	pool.started = 0;
+	pool.stop = false;
+}
+
+static void pool_start() {
+	static bool registered = false;
+	if (!registered) {
+		atexit(pool_stop);
+		registered = true;
+	}
+	if (pool.size == 0)
+		pool_init(0);
+	for (; pool.started < pool.size - 1; ++pool.started) {
+		if (pthread_create(&pool.threads[pool.started], NULL, worker,
+					(void *) (uintptr_t) pool.job) != 0) {
+			/* make do with the ones we have */
+			pool.size = pool.started + 1;
+			break;
+		}
+	}
+}
+
+void pool_init(int n) {
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0)
+		n = 1;
+	if (n > POOLMAX)
+		n = POOLMAX;
+	if (pool.started > 0)
+		pool_stop();
+	pool.size = n;
+}
+
+int pool_size() {
+	if (pool.size == 0)
+		pool_init(0);
+	return pool.size;
+}
+
+void pool_run(int n, void (*fn)(void *arg, int i), void *arg) {
+	if (n <= 0)
+		return;
+	if (n == 1 || intask || pool_size() == 1) {
+		for (int i = 0; i < n; ++i)
+			fn(arg, i);
+		return;
+	}
+	if (pool.started < pool.size - 1)
+		pool_start();
+
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.n = n;
+	pool.next = 0;
+	pool.busy = pool.started;
+	pool.job++;
+	pthread_cond_broadcast(&pool.work);
+	drain();
+	/* the job (and `arg`) must outlive every worker still looking at it */
+	while (pool.busy > 0)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+int pool_parts(long n, long min) {
+	long parts = n / min;
+	if (parts > pool_size())
+		parts = pool_size();
+	return (parts < 1) ? 1 : parts;
+}
+
+void pool_slice(long from, long to, int parts, int i, long *lo, long *hi) {
+	long n = to - from + 1;
+	*lo = from + n * i / parts;
+	*hi = from + n * (i + 1) / parts - 1;
+}
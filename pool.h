@@ -0,0 +1,27 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* A pool of worker threads for splitting work on the buffer over several
+ * cores. The workers are started on first use and sleep in between. The
+ * buffer must not change while a job runs, the tasks only read it.
+ */
+
+/* Use `n` threads, counting the caller (0 for one per online CPU) */
+void pool_init(int n);
+int pool_size();
+
+/* Run fn(arg, i) for every i in [0, n), spread over the pool; the calling
+ * thread takes part. Returns once all of them are done. Tasks must not
+ * longjmp() out of themselves (no io_err() they don't catch), and jobs
+ * they start run in the task's thread, one task after the other.
+ */
+void pool_run(int n, void (*fn)(void *arg, int i), void *arg);
+
+/* Splitting a range of lines: how many parts to make of `n` lines so
+ * that every thread gets one, but none is shorter than `min`, and the
+ * lines [lo, hi] of part `i`.
+ */
+int pool_parts(long n, long min);
+void pool_slice(long from, long to, int parts, int i, long *lo, long *hi);
+
+#endif
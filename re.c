@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <regex.h>
+
+#include "ed.h"
+#include "re.h"
+#include "scan.h"
+#include "stats.h"
+
+static _Thread_local struct {
+	char *pattern;		/* NULL if the slot is free */
+	re_t re;
+	unsigned long used;	/* when it was last handed out */
+} cache[RECACHE];
+
+static _Thread_local unsigned long tick;
+/* the last pattern is the buffer's, state.pattern */
+#define last (state.pattern)
+
+const char *re_last() {
+	return last;
+}
+
+static void setlast(const char *pattern) {
+	if (last != NULL && strcmp(last, pattern) == 0)
+		return;
+	char *s = strdup(pattern);
+	if (s == NULL)
+		io_err("strdup: %s\n", strerror(errno));
+	free(last);
+	last = s;
+}
+
+/* past the bracket expression at `p`, NULL if it doesn't end */
+static const char *skipbracket(const char *p) {
+	p++;
+	if (*p == '^')
+		p++;
+	if (*p == ']')
+		p++;
+	while (*p != ']') {
+		if (*p == '\0')
+			return NULL;
+		if (p[0] == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+			char end[3] = { p[1], ']', '\0' };
+			if ((p = strstr(p + 2, end)) == NULL)
+				return NULL;
+			p += 2;
+		}
+		else {
+			p++;
+		}
+	}
+	return p + 1;
+}
+
+/* past the parenthesized group at `p`, NULL if it doesn't end */
+static const char *skipgroup(const char *p) {
+	int depth = 0;
+	do {
+		if (*p == '\0')
+			return NULL;
+		if (*p == '\\') {
+			if (*++p == '\0')
+				return NULL;
+		}
+		else if (*p == '[') {
+			if ((p = skipbracket(p)) == NULL)
+				return NULL;
+			continue;
+		}
+		else if (*p == '(') {
+			depth++;
+		}
+		else if (*p == ')') {
+			depth--;
+		}
+		p++;
+	} while (depth > 0);
+	return p;
+}
+
+/* Find the longest run of plain characters that every match of the
+ * extended `pattern` has to contain: atoms outside groups that aren't
+ * made optional by a quantifier. Anything odd, like | at the top level,
+ * means there is none. Wrong guesses would lose matches, so this is
+ * conservative rather than clever.
+ */
+static void analyze(re_t *re, const char *p) {
+	size_t plen = strlen(p);
+	char *run = malloc(plen + 1);
+	char *best = malloc(plen + 1);
+	size_t runlen = 0, bestlen = 0;
+	bool pure = true;
+
+	if (run == NULL || best == NULL || !(re->cflags & REG_EXTENDED) ||
+			(re->cflags & (REG_ICASE | REG_NEWLINE)))
+		goto none;
+	while (*p) {
+		char c = 0;
+		bool lit = false;
+		switch (*p) {
+			case '\\':
+				/* \1, \w, \< and friends aren't plain */
+				if (p[1] == '\0')
+					goto none;
+				lit = !isalnum((unsigned char) p[1]);
+				c = p[1];
+				p += 2;
+				break;
+			case '[':
+				if ((p = skipbracket(p)) == NULL)
+					goto none;
+				break;
+			case '(':
+				if ((p = skipgroup(p)) == NULL)
+					goto none;
+				break;
+			case '.': case '^': case '$':
+				p++;
+				break;
+			case '|': case ')': case '*': case '+': case '?': case '{':
+				goto none;
+			default:
+				lit = true;
+				c = *p++;
+		}
+
+		/* quantifiers apply to the atom just read */
+		bool quant = false;
+		bool optional = false;
+		while (*p == '*' || *p == '+' || *p == '?' || *p == '{') {
+			quant = true;
+			if (*p == '{') {
+				if (!isdigit((unsigned char) p[1]))
+					goto none;
+				optional |= strtol(p + 1, NULL, 10) == 0;
+				if ((p = strchr(p, '}')) == NULL)
+					goto none;
+			}
+			else {
+				optional |= *p != '+';
+			}
+			p++;
+		}
+
+		if (lit && !optional)
+			run[runlen++] = c;
+		if (!lit || quant) {
+			pure = false;
+			if (runlen > bestlen) {
+				memcpy(best, run, runlen);
+				bestlen = runlen;
+			}
+			runlen = 0;
+		}
+	}
+	if (runlen > bestlen) {
+		memcpy(best, run, runlen);
+		bestlen = runlen;
+	}
+	if (bestlen == 0)
+		goto none;
+	free(run);
+	re->lit = best;
+	re->litlen = bestlen;
+	re->pure = pure;
+	return;
+none:
+	free(run);
+	free(best);
+	re->lit = NULL;
+	re->litlen = 0;
+	re->pure = false;
+}
+
+/* look `pattern` up or compile it into the least recently used slot,
+ * on errors return NULL with the slot in `victim` and the code in `ret`
+ */
+static re_t *lookup(const char *pattern, int cflags, int *victim, int *ret) {
+	*victim = 0;
+	for (int i = 0; i < RECACHE; ++i) {
+		if (cache[i].pattern != NULL && cache[i].re.cflags == cflags &&
+				strcmp(cache[i].pattern, pattern) == 0) {
+			cache[i].used = ++tick;
+			return &cache[i].re;
+		}
+		if (cache[i].pattern == NULL ||
+				(cache[*victim].pattern != NULL && cache[i].used < cache[*victim].used))
+			*victim = i;
+	}
+
+	int v = *victim;
+	if (cache[v].pattern != NULL) {
+		regfree(&cache[v].re.reg);
+		free(cache[v].re.lit);
+		free(cache[v].pattern);
+		cache[v].pattern = NULL;
+	}
+	uint64_t start = STATS_START();
+	*ret = regcomp(&cache[v].re.reg, pattern, cflags);
+	STATS_STOP(STAT_REGCOMP, start, 1, 0);
+	if (*ret != 0)
+		return NULL;
+	if ((cache[v].pattern = strdup(pattern)) == NULL) {
+		regfree(&cache[v].re.reg);
+		*ret = REG_ESPACE;
+		return NULL;
+	}
+	cache[v].re.cflags = cflags;
+	analyze(&cache[v].re, pattern);
+	cache[v].used = ++tick;
+	return &cache[v].re;
+}
+
+re_t *re_get(const char *pattern, int cflags) {
+	if (pattern == NULL || *pattern == '\0') {
+		if (last == NULL)
+			io_err("No previous regular expression\n");
+		pattern = last;
+	}
+
+	int victim, ret;
+	re_t *re = lookup(pattern, cflags, &victim, &ret);
+	if (re == NULL)
+		io_reg_err(&cache[victim].re.reg, ret);
+	setlast(pattern);
+	return re;
+}
+
+re_t *re_compile(const char *pattern, int cflags) {
+	int victim, ret;
+	return lookup(pattern, cflags, &victim, &ret);
+}
+
+void re_free() {
+	for (int i = 0; i < RECACHE; ++i) {
+		if (cache[i].pattern != NULL) {
+			regfree(&cache[i].re.reg);
+			free(cache[i].re.lit);
+			free(cache[i].pattern);
+			cache[i].pattern = NULL;
+		}
+	}
+	free(last);
+	last = NULL;
+}
+
+int re_exec(const re_t *re, const char *s, size_t nmatch, regmatch_t *m, int eflags) {
+	if (re->lit != NULL) {
+		const char *from = s + m[0].rm_so;
+		const char *p = scan_memmem(from, m[0].rm_eo - m[0].rm_so, re->lit, re->litlen);
+		if (p == NULL)
+			return REG_NOMATCH;
+		if (re->pure) {
+			if (!(re->cflags & REG_NOSUB) && nmatch > 0) {
+				m[0].rm_so = p - s;
+				m[0].rm_eo = m[0].rm_so + re->litlen;
+				for (size_t i = 1; i < nmatch; ++i)
+					m[i].rm_so = m[i].rm_eo = -1;
+			}
+			return 0;
+		}
+	}
+	return regexec(&re->reg, s, nmatch, m, eflags | REG_STARTEND);
+}
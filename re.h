@@ -0,0 +1,48 @@
+#ifndef RE_H
+#define RE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <regex.h>
+
+/* Compiled regular expressions. Scripts tend to repeat the same few
+ * patterns, so the last RECACHE compiles are kept around and reused
+ * instead of calling regcomp() for every command. Every thread has a
+ * cache of its own: glibc locks a regex_t while it matches, so threads
+ * sharing one would take turns.
+ */
+
+#define RECACHE 16
+
+/* A compiled pattern and what is known about it. Most patterns are a
+ * plain string or contain one every match has to (ERROR.*timeout), so
+ * lines without it are turned down with scan_memmem() before regexec()
+ * gets to see them, and plain strings don't need regexec() at all.
+ */
+typedef struct re {
+	regex_t reg;
+	int cflags;
+	char *lit;	/* a string every match contains, NULL if none is known */
+	size_t litlen;
+	bool pure;	/* the pattern matches just `lit` */
+}re_t;
+
+/* `pattern` compiled with `cflags`. An empty (or NULL) pattern is the
+ * last one that was asked for. Errors go to io_reg_err(). The result
+ * belongs to the cache and stays valid until RECACHE other patterns
+ * have been compiled.
+ */
+re_t *re_get(const char *pattern, int cflags);
+/* The same for the pool's workers: it leaves the last pattern alone and
+ * returns NULL on errors instead.
+ */
+re_t *re_compile(const char *pattern, int cflags);
+/* the current buffer's last pattern, NULL before the first */
+const char *re_last();
+/* free the calling thread's cache */
+void re_free();
+
+/* regexec() of `s` from m[0].rm_so to m[0].rm_eo, as with REG_STARTEND */
+int re_exec(const re_t *re, const char *s, size_t nmatch, regmatch_t *m, int eflags);
+
+#endif
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+typedef size_t (*scanfn_t)(const char *, const char *, const char **, size_t);
+typedef const char *(*memmemfn_t)(const char *, size_t, const char *, size_t);
+typedef const char *(*plainfn_t)(const char *, const char *);
+
+static size_t scan_scalar(const char *p, const char *end, const char **nl, size_t max) {
+	size_t n = 0;
+	while (n < max && p < end) {
+		const char *q = memchr(p, '\n', end - p);
+		if (q == NULL)
+			break;
+		nl[n++] = q;
+		p = q + 1;
+	}
+	return n;
+}
+
+/* glibc's is a two-way search */
+static const char *memmem_scalar(const char *h, size_t hlen, const char *n, size_t nlen) {
+	return memmem(h, hlen, n, nlen);
+}
+
+/* what l escapes: \ and all but printable ASCII */
+#define ESCAPED(c) ((c) < 0x20 || (c) >= 0x7f || (c) == '\\')
+
+static const char *unprintable_scalar(const char *p, const char *end) {
+	while (p < end && !ESCAPED((unsigned char) *p))
+		p++;
+	return p;
+}
+
+#ifdef SCAN_X86
+/* record the newlines set in `mask` for the block at `p` */
+#define SCAN_MASK(mask, p) \
+	while (mask) { \
+		nl[n++] = (p) + __builtin_ctz(mask); \
+		if (n == max) \
+			return n; \
+		mask &= mask - 1; \
+	}
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *p, const char *end, const char **nl, size_t max) {
+	size_t n = 0;
+	const __m128i c = _mm_set1_epi8('\n');
+	if (max == 0)
+		return 0;
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, c));
+		SCAN_MASK(mask, p);
+	}
+	return n + scan_scalar(p, end, nl + n, max - n);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *p, const char *end, const char **nl, size_t max) {
+	size_t n = 0;
+	const __m256i c = _mm256_set1_epi8('\n');
+	if (max == 0)
+		return 0;
+	for (; end - p >= 64; p += 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *) p);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *) (p + 32));
+		uint64_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, c)) |
+			((uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, c)) << 32);
+		while (mask) {
+			nl[n++] = p + __builtin_ctzll(mask);
+			if (n == max)
+				return n;
+			mask &= mask - 1;
+		}
+	}
+	for (; end - p >= 32; p += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, c));
+		SCAN_MASK(mask, p);
+	}
+	return n + scan_scalar(p, end, nl + n, max - n);
+}
+
+/* Substring search comparing a block of positions at a time against the
+ * first and the last byte of the needle, only the positions where both
+ * match are compared in full.
+ */
+#define MEMMEM_BLOCK(mask, p) \
+	while (mask) { \
+		const char *c = (p) + __builtin_ctz(mask); \
+		if (memcmp(c + 1, n + 1, nlen - 2) == 0) \
+			return c; \
+		mask &= mask - 1; \
+	}
+
+__attribute__((target("sse2")))
+static const char *memmem_sse2(const char *h, size_t hlen, const char *n, size_t nlen) {
+	if (nlen < 2 || hlen < nlen)
+		return memmem(h, hlen, n, nlen);
+	const __m128i first = _mm_set1_epi8(n[0]);
+	const __m128i last = _mm_set1_epi8(n[nlen-1]);
+	const char *p = h;
+	for (; (size_t) (h + hlen - p) >= nlen - 1 + 16; p += 16) {
+		__m128i f = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *) p));
+		__m128i l = _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *) (p + nlen - 1)));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(f, l));
+		MEMMEM_BLOCK(mask, p);
+	}
+	return memmem(p, h + hlen - p, n, nlen);
+}
+
+__attribute__((target("avx2")))
+static const char *memmem_avx2(const char *h, size_t hlen, const char *n, size_t nlen) {
+	if (nlen < 2 || hlen < nlen)
+		return memmem(h, hlen, n, nlen);
+	const __m256i first = _mm256_set1_epi8(n[0]);
+	const __m256i last = _mm256_set1_epi8(n[nlen-1]);
+	const char *p = h;
+	for (; (size_t) (h + hlen - p) >= nlen - 1 + 32; p += 32) {
+		__m256i f = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i *) p));
+		__m256i l = _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i *) (p + nlen - 1)));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(f, l));
+		MEMMEM_BLOCK(mask, p);
+	}
+	return memmem_sse2(p, h + hlen - p, n, nlen);
+}
+
+/* Bytes compare as signed, so the ones from 0x80 up are below 0x20 along
+ * with the control characters and a byte is printable if it is above 0x1f
+ * and below 0x7f.
+ */
+__attribute__((target("sse2")))
+static const char *unprintable_sse2(const char *p, const char *end) {
+	const __m128i lo = _mm_set1_epi8(0x1f);
+	const __m128i hi = _mm_set1_epi8(0x7f);
+	const __m128i bs = _mm_set1_epi8('\\');
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+		uint32_t mask = (~_mm_movemask_epi8(ok) & 0xffff) |
+			_mm_movemask_epi8(_mm_cmpeq_epi8(v, bs));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+	return unprintable_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *unprintable_avx2(const char *p, const char *end) {
+	const __m256i lo = _mm256_set1_epi8(0x1f);
+	const __m256i hi = _mm256_set1_epi8(0x7f);
+	const __m256i bs = _mm256_set1_epi8('\\');
+	for (; end - p >= 32; p += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+		__m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+		uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(ok) |
+			(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, bs));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+	return unprintable_sse2(p, end);
+}
+#endif
+
+static struct {
+	const char *name;
+	scanfn_t fn;
+	memmemfn_t memmem;
+	plainfn_t unprintable;
+} scanners[] = {
+#ifdef SCAN_X86
+	{ "avx2", scan_avx2, memmem_avx2, unprintable_avx2 },
+	{ "sse2", scan_sse2, memmem_sse2, unprintable_sse2 },
+#endif
+	{ "scalar", scan_scalar, memmem_scalar, unprintable_scalar },
+};
+
+#define NSCANNERS (sizeof(scanners) / sizeof(scanners[0]))
+
+/* picked by the first thread to scan, batch mode has several at once */
+static _Atomic int scanner = -1;
+
+static int supported(const char *name) {
+#ifdef SCAN_X86
+	if (strcmp(name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+	if (strcmp(name, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return strcmp(name, "scalar") == 0;
+}
+
+int scan_use(const char *name) {
+	for (size_t i = 0; i < NSCANNERS; ++i) {
+		if (strcmp(scanners[i].name, name) == 0 && supported(name)) {
+			scanner = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* the first supported one, scanners[] is in order of preference */
+static void scan_pick() {
+	for (size_t i = 0; i < NSCANNERS; ++i) {
+		if (supported(scanners[i].name)) {
+			scanner = i;
+			return;
+		}
+	}
+}
+
+const char *scan_name() {
+	if (scanner == -1)
+		scan_pick();
+	return scanners[scanner].name;
+}
+
+size_t scan_newlines(const char *p, const char *end, const char **nl, size_t max) {
+	if (scanner == -1)
+		scan_pick();
+	return scanners[scanner].fn(p, end, nl, max);
+}
+
+const char *scan_memmem(const char *h, size_t hlen, const char *n, size_t nlen) {
+	if (scanner == -1)
+		scan_pick();
+	return scanners[scanner].memmem(h, hlen, n, nlen);
+}
+
+const char *scan_unprintable(const char *p, const char *end) {
+	if (scanner == -1)
+		scan_pick();
+	return scanners[scanner].unprintable(p, end);
+}
@@ -0,0 +1,35 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/* Newline scanning. The vector versions compare a block of bytes at a
+ * time against '\n' and walk the resulting bit mask, so short lines cost
+ * a couple of instructions each instead of a call to memchr(). The best
+ * version the CPU supports is picked on first use.
+ */
+
+/* Store pointers to up to `max` newlines in [p, end) in `nl`,
+ * returns how many were found.
+ */
+size_t scan_newlines(const char *p, const char *end, const char **nl, size_t max);
+
+/* The first occurrence of the `nlen` bytes at `n` in the `hlen` at `h`,
+ * NULL if there is none. The vector versions check the needle's first
+ * and last byte at a block of positions at once.
+ */
+const char *scan_memmem(const char *h, size_t hlen, const char *n, size_t nlen);
+
+/* The first byte in [p, end) that l has to escape, a backslash or one
+ * that isn't printable ASCII, or `end`. The vector versions check a block
+ * of bytes at a time.
+ */
+const char *scan_unprintable(const char *p, const char *end);
+
+/* Force a version: "avx2", "sse2" or "scalar". Returns -1 if the
+ * CPU doesn't support it. For benchmarking mainly.
+ */
+int scan_use(const char *name);
+const char *scan_name();
+
+#endif
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "stats.h"
+
+bool stats_on;
+
+/* added to by the pool's workers too */
+static struct {
+	atomic_ulong count;
+	atomic_ulong ns;
+	atomic_ulong bytes;
+}stats[STATS];
+
+static const char *names[STATS] = {
+	[STAT_PARSE] = "parse",
+	[STAT_ADDRESS] = "address",
+	[STAT_REGCOMP] = "regcomp",
+	[STAT_REGEXEC] = "regexec",
+	[STAT_SEARCH] = "search",
+	[STAT_SUBST] = "subst",
+	[STAT_WRITE] = "write",
+	[STAT_ALLOC] = "alloc",
+};
+
+/* commands run on the main thread, or on all of them in batch mode */
+static struct {
+	atomic_ulong count;
+	atomic_ulong ns;
+}commands[128];
+
+uint64_t stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_add(stat_t st, uint64_t ns, long n, size_t bytes) {
+	atomic_fetch_add_explicit(&stats[st].count, n, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats[st].ns, ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats[st].bytes, bytes, memory_order_relaxed);
+}
+
+void stats_command(int cmd, uint64_t ns) {
+	if (cmd < 0 || cmd >= 128)
+		return;
+	atomic_fetch_add_explicit(&commands[cmd].count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&commands[cmd].ns, ns, memory_order_relaxed);
+}
+
+void stats_json(FILE *fp) {
+	fprintf(fp, "{\"commands\": {");
+	const char *sep = "";
+	for (int c = 0; c < 128; ++c) {
+		if (atomic_load(&commands[c].count) == 0)
+			continue;
+		/* the names are command characters, a newline is an empty one */
+		char name[8];
+		if (c < ' ')
+			snprintf(name, sizeof(name), "\\u%04x", c);
+		else
+			snprintf(name, sizeof(name), "%s%c", (c == '"' || c == '\\') ? "\\" : "", c);
+		fprintf(fp, "%s\"%s\": {\"count\": %lu, \"seconds\": %.6f}", sep,
+				name, atomic_load(&commands[c].count), atomic_load(&commands[c].ns) / 1e9);
+		sep = ", ";
+	}
+	fprintf(fp, "}");
+	for (int i = 0; i < STATS; ++i) {
+		fprintf(fp, ", \"%s\": {\"count\": %lu, \"seconds\": %.6f, \"bytes\": %lu}",
+				names[i], atomic_load(&stats[i].count),
+				atomic_load(&stats[i].ns) / 1e9, atomic_load(&stats[i].bytes));
+	}
+	fprintf(fp, "}\n");
+}
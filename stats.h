@@ -0,0 +1,44 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Counters and timers of where a session's time goes: every command and
+ * the hot paths under it. Collecting is off unless asked for (-t), and
+ * then every measuring point costs a test of `stats_on`. Workers add to
+ * the totals once a part, not once a line.
+ */
+
+typedef enum {
+	STAT_PARSE,	/* parse(), addresses included */
+	STAT_ADDRESS,	/* parse_address() */
+	STAT_REGCOMP,	/* regcomp() of patterns not cached */
+	STAT_REGEXEC,	/* the match loops of searches and s, a part at a time */
+	STAT_SEARCH,	/* ll_reg_search() */
+	STAT_SUBST,	/* strrep(), over all threads */
+	STAT_WRITE,	/* io_write_file() and the bytes it wrote */
+	STAT_ALLOC,	/* line text and chunks taken by the buffer */
+	STATS
+}stat_t;
+
+extern bool stats_on;
+
+/* nanoseconds on the monotonic clock */
+uint64_t stats_now();
+/* add `n` events of `bytes` bytes taking `ns` to `st` */
+void stats_add(stat_t st, uint64_t ns, long n, size_t bytes);
+/* command `cmd` ran once, taking `ns` */
+void stats_command(int cmd, uint64_t ns);
+
+#define STATS_START() ((stats_on) ? stats_now() : 0)
+#define STATS_STOP(st, start, n, bytes) \
+	do { if (stats_on) stats_add((st), stats_now() - (start), (n), (bytes)); } while (0)
+#define STATS_COUNT(st, n, bytes) \
+	do { if (stats_on) stats_add((st), 0, (n), (bytes)); } while (0)
+
+/* all of it as a JSON object */
+void stats_json(FILE *fp);
+
+#endif